@@ -0,0 +1,363 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "arena.h"
+
+#define ARENA_MAGIC	0x414e4552414d5650UL	/* "PVMARENA" */
+
+/**
+ * Layout of the arena and of the simulator state in it. Arenas of the other
+ * versions are refused rather than restored as garbage.
+ */
+#define ARENA_VERSION	1
+
+/**
+ * Objects are allocated in power-of-two size classes from MIN_OBJECT_SIZE.
+ * Each object is preceded by a header telling its size class, and the freed
+ * objects are chained in the free list of their size class.
+ */
+#define MIN_OBJECT_SHIFT	4
+#define MIN_OBJECT_SIZE		(1UL << MIN_OBJECT_SHIFT)
+#define NR_SIZE_CLASSES		40
+
+struct object_header {
+	unsigned long size_class;
+	union {
+		struct object_header *next_free;
+		unsigned long __pad;
+	};
+};
+
+/**
+ * Persistent global variable. @addr is where the variable was at the run
+ * that saved it, which is needed to relink the list heads.
+ */
+struct arena_slot {
+	void *addr;
+	size_t size;
+	void *data;
+};
+
+struct arena_header {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long base;
+	unsigned long size;
+	unsigned long brk;	/* Offset of the first byte never allocated */
+	bool saved;		/* Global variables are saved in the slots */
+
+	struct object_header *free_lists[NR_SIZE_CLASSES];
+
+	unsigned int nr_slots;
+	struct arena_slot slots[MAX_ARENA_SLOTS];
+};
+
+static struct arena_header *arena = NULL;
+static bool restored = false;
+
+/**
+ * Global variables registered to persist at this run
+ */
+static struct {
+	void *addr;
+	size_t size;
+} globals[MAX_ARENA_SLOTS];
+static unsigned int nr_globals = 0;
+
+static int arena_fd = -1;
+
+/* The arena is anonymous, and thus nothing persists */
+static bool anonymous = false;
+
+
+bool open_arena(const char *path)
+{
+	struct stat st;
+	bool fresh;
+	void *addr;
+
+	arena_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (arena_fd < 0) {
+		perror("open");
+		return false;
+	}
+	if (fstat(arena_fd, &st) < 0) goto out_close;
+
+	/* Initialize the file only if it is new or empty, not to clobber others */
+	fresh = st.st_size == 0;
+	if (fresh) {
+		if (ftruncate(arena_fd, ARENA_SIZE) < 0) {
+			perror("ftruncate");
+			goto out_close;
+		}
+	} else if (st.st_size != ARENA_SIZE) {
+		fprintf(stderr, "%s is not an arena\n", path);
+		goto out_close;
+	}
+
+	addr = mmap((void *)ARENA_BASE, ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED_NOREPLACE | MAP_NORESERVE, arena_fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
+	}
+	if (addr != (void *)ARENA_BASE) {
+		fprintf(stderr, "Unable to map the arena at %#lx\n", ARENA_BASE);
+		munmap(addr, ARENA_SIZE);
+		goto out_close;
+	}
+	arena = addr;
+
+	if (fresh) {
+		arena->magic = ARENA_MAGIC;
+		arena->version = ARENA_VERSION;
+		arena->base = ARENA_BASE;
+		arena->size = ARENA_SIZE;
+		arena->brk = sizeof(*arena);
+	} else if (arena->magic != ARENA_MAGIC) {
+		fprintf(stderr, "%s is not an arena\n", path);
+		goto out_unmap;
+	} else if (arena->version != ARENA_VERSION) {
+		fprintf(stderr, "Arena %s is of version %lu, not %d\n", path,
+				arena->version, ARENA_VERSION);
+		goto out_unmap;
+	} else if (arena->base != ARENA_BASE || arena->size != ARENA_SIZE) {
+		fprintf(stderr, "Incompatible arena %s\n", path);
+		goto out_unmap;
+	}
+	restored = arena->saved;
+
+	return true;
+
+out_unmap:
+	munmap(addr, ARENA_SIZE);
+	arena = NULL;
+out_close:
+	close(arena_fd);
+	arena_fd = -1;
+	return false;
+}
+
+bool open_anon_arena(bool huge)
+{
+	unsigned long start, end;
+	void *addr;
+
+	/* Over-map by a huge page to cut the arena out at a huge page boundary */
+	addr = mmap(NULL, ARENA_SIZE + HOST_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	start = ((unsigned long)addr + HOST_HUGE_PAGE_SIZE - 1) & ~(HOST_HUGE_PAGE_SIZE - 1);
+	end = (unsigned long)addr + ARENA_SIZE + HOST_HUGE_PAGE_SIZE;
+
+	if (start > (unsigned long)addr) munmap(addr, start - (unsigned long)addr);
+	if (end > start + ARENA_SIZE) munmap((void *)(start + ARENA_SIZE), end - start - ARENA_SIZE);
+
+	/**
+	 * The advice fails if the host kernel does not support the transparent
+	 * huge pages. Keep going with the base pages then.
+	 */
+	if (madvise((void *)start, ARENA_SIZE, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) < 0) {
+		if (huge) perror("madvise");
+	}
+
+	arena = (void *)start;
+	arena->magic = ARENA_MAGIC;
+	arena->version = ARENA_VERSION;
+	arena->base = start;
+	arena->size = ARENA_SIZE;
+	arena->brk = sizeof(*arena);
+	anonymous = true;
+
+	return true;
+}
+
+void close_arena(void)
+{
+	if (!arena) return;
+
+	if (anonymous) {
+		munmap(arena, ARENA_SIZE);
+		arena = NULL;
+		anonymous = false;
+		return;
+	}
+
+	sync_arena();
+	msync(arena, arena->brk, MS_SYNC);
+	munmap(arena, ARENA_SIZE);
+	close(arena_fd);
+
+	arena = NULL;
+	arena_fd = -1;
+}
+
+bool arena_extent(void **start, size_t *size)
+{
+	if (!arena) return false;
+
+	*start = arena;
+	*size = arena->brk;
+	return true;
+}
+
+bool arena_restored(void)
+{
+	return restored;
+}
+
+void arena_persist(void *addr, size_t size)
+{
+	struct arena_slot *slot;
+
+	if (!arena || anonymous) return;
+	if (nr_globals == MAX_ARENA_SLOTS) {
+		fprintf(stderr, "Too many persistent variables\n");
+		abort();
+	}
+	globals[nr_globals].addr = addr;
+	globals[nr_globals].size = size;
+	slot = &arena->slots[nr_globals++];
+
+	if (restored) {
+		if (slot->size != size) {
+			fprintf(stderr, "Arena does not match the simulator\n");
+			abort();
+		}
+		memcpy(addr, slot->data, size);
+		return;
+	}
+
+	slot->addr = addr;
+	slot->size = size;
+	slot->data = arena_calloc(1, size);
+	arena->nr_slots = nr_globals;
+}
+
+void arena_persist_list(struct list_head *head)
+{
+	struct arena_slot *slot;
+
+	if (!arena || anonymous) return;
+
+	slot = &arena->slots[nr_globals];
+	arena_persist(head, sizeof(*head));
+	if (!restored) return;
+
+	/* The list was empty if the head pointed itself at the previous run */
+	if (head->next == slot->addr) {
+		INIT_LIST_HEAD(head);
+	} else {
+		head->next->prev = head;
+		head->prev->next = head;
+	}
+}
+
+void sync_arena(void)
+{
+	if (!arena || anonymous) return;
+
+	for (unsigned int i = 0; i < nr_globals; i++) {
+		arena->slots[i].addr = globals[i].addr;
+		memcpy(arena->slots[i].data, globals[i].addr, globals[i].size);
+	}
+	arena->saved = true;
+}
+
+
+void *arena_malloc(size_t size)
+{
+	struct object_header *object;
+	unsigned int size_class = 0;
+
+	if (!arena) return malloc(size);
+
+	while ((MIN_OBJECT_SIZE << size_class) < size) size_class++;
+	if (size_class >= NR_SIZE_CLASSES) return NULL;
+
+	object = arena->free_lists[size_class];
+	if (object) {
+		arena->free_lists[size_class] = object->next_free;
+	} else {
+		unsigned long object_size = sizeof(*object) + (MIN_OBJECT_SIZE << size_class);
+
+		if (arena->brk + object_size > arena->size) return NULL;
+
+		object = (void *)arena + arena->brk;
+		arena->brk += object_size;
+	}
+	object->size_class = size_class;
+
+	return object + 1;
+}
+
+void *arena_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (!arena) return calloc(nmemb, size);
+
+	ptr = arena_malloc(nmemb * size);
+	if (ptr) memset(ptr, 0x00, nmemb * size);
+	return ptr;
+}
+
+void *arena_realloc(void *ptr, size_t size)
+{
+	struct object_header *object;
+	void *new;
+
+	if (!arena) return realloc(ptr, size);
+	if (!ptr) return arena_malloc(size);
+
+	object = (struct object_header *)ptr - 1;
+	if (size <= (MIN_OBJECT_SIZE << object->size_class)) return ptr;
+
+	new = arena_malloc(size);
+	if (!new) return NULL;
+
+	memcpy(new, ptr, MIN_OBJECT_SIZE << object->size_class);
+	arena_free(ptr);
+
+	return new;
+}
+
+void arena_free(void *ptr)
+{
+	struct object_header *object;
+
+	if (!arena) {
+		free(ptr);
+		return;
+	}
+	if (!ptr) return;
+
+	object = (struct object_header *)ptr - 1;
+	object->next_free = arena->free_lists[object->size_class];
+	arena->free_lists[object->size_class] = object;
+}
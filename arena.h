@@ -0,0 +1,134 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * The arena is a memory-mapped file holding the simulator state. It is
+ * always mapped at ARENA_BASE so that the pointers stored in the arena remain
+ * valid across runs, and the file is sparse so that it takes the space for
+ * the allocated objects only.
+ */
+#define ARENA_BASE	0x200000000000UL
+#define ARENA_SIZE	(16UL << 30)
+
+/* Host huge page size to align the anonymous arena to */
+#define HOST_HUGE_PAGE_SIZE	(2UL << 20)
+
+/* The maximum number of global variables the arena can persist */
+#define MAX_ARENA_SLOTS	32
+
+/***********************************************************************
+ * open_arena()
+ *
+ * DESCRIPTION
+ *  Map the arena file at @path. The file is created if it does not exist,
+ *  and initialized if it is empty. Non-empty files other than the arenas of
+ *  the same version are refused. Once the arena is open, the arena
+ *  allocation functions allocate the objects from the arena. Otherwise, they
+ *  fall back to the standard allocator.
+ *
+ * RETURN VALUE
+ *  Return @true on success
+ *  Return @false if unable to map the file
+ */
+bool open_arena(const char *path);
+
+/***********************************************************************
+ * open_anon_arena()
+ *
+ * DESCRIPTION
+ *  Map an anonymous arena aligned to HOST_HUGE_PAGE_SIZE. The objects are
+ *  allocated from the arena as for open_arena(), but nothing persists. If
+ *  @huge is @true, the arena is advised to be backed by the transparent huge
+ *  pages of the host. Otherwise, it is advised not to.
+ *
+ * RETURN VALUE
+ *  Return @true on success
+ *  Return @false if unable to map the arena
+ */
+bool open_anon_arena(bool huge);
+
+/***********************************************************************
+ * arena_extent()
+ *
+ * DESCRIPTION
+ *  Tell the part of the arena the objects have been allocated from.
+ *
+ * RETURN VALUE
+ *  Return @true if the arena is open
+ */
+bool arena_extent(void **start, size_t *size);
+
+/***********************************************************************
+ * close_arena()
+ *
+ * DESCRIPTION
+ *  Save the persistent global variables and unmap the arena.
+ */
+void close_arena(void);
+
+/***********************************************************************
+ * arena_restored()
+ *
+ * RETURN VALUE
+ *  Return @true if the arena holds the state saved by a previous run
+ */
+bool arena_restored(void);
+
+/***********************************************************************
+ * arena_persist()
+ *
+ * DESCRIPTION
+ *  Make the global variable at @addr of @size bytes persist in the arena.
+ *  The variables should be registered in the same order at every run. When
+ *  the arena holds the saved state, the variable is restored immediately.
+ */
+void arena_persist(void *addr, size_t size);
+
+/***********************************************************************
+ * arena_persist_list()
+ *
+ * DESCRIPTION
+ *  Same as arena_persist(), but for the global list head @head. The list
+ *  entries linked to the head at the previous run are linked to @head again.
+ */
+struct list_head;
+void arena_persist_list(struct list_head *head);
+
+/***********************************************************************
+ * sync_arena()
+ *
+ * DESCRIPTION
+ *  Save the persistent global variables into the arena.
+ */
+void sync_arena(void);
+
+/***********************************************************************
+ * arena_malloc(), arena_calloc(), arena_realloc(), arena_free()
+ *
+ * DESCRIPTION
+ *  Same as malloc(), calloc(), realloc(), and free() but for the arena.
+ */
+void *arena_malloc(size_t size);
+void *arena_calloc(size_t nmemb, size_t size);
+void *arena_realloc(void *ptr, size_t size);
+void arena_free(void *ptr);
+
+#endif
@@ -0,0 +1,147 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+
+#include "types.h"
+#include "cache.h"
+
+struct cache_line {
+	bool valid;
+	unsigned long tag;
+	unsigned long lru;
+};
+
+struct cache {
+	const char *name;
+	unsigned int nr_sets;
+	unsigned int nr_ways;
+	unsigned int cycles;
+	struct cache_line *lines;
+};
+
+#define NR_LINES(size)	((size) / CACHE_LINE_SIZE)
+
+static struct cache_line l1_lines[NR_LINES(L1_SIZE)];
+static struct cache_line l2_lines[NR_LINES(L2_SIZE)];
+static struct cache_line llc_lines[NR_LINES(LLC_SIZE)];
+
+static struct cache caches[] = {
+	[CACHE_L1] = {
+		.name = "L1",
+		.nr_sets = NR_LINES(L1_SIZE) / L1_WAYS,
+		.nr_ways = L1_WAYS,
+		.cycles = L1_CYCLES,
+		.lines = l1_lines,
+	},
+	[CACHE_L2] = {
+		.name = "L2",
+		.nr_sets = NR_LINES(L2_SIZE) / L2_WAYS,
+		.nr_ways = L2_WAYS,
+		.cycles = L2_CYCLES,
+		.lines = l2_lines,
+	},
+	[CACHE_LLC] = {
+		.name = "LLC",
+		.nr_sets = NR_LINES(LLC_SIZE) / LLC_WAYS,
+		.nr_ways = LLC_WAYS,
+		.cycles = LLC_CYCLES,
+		.lines = llc_lines,
+	},
+};
+
+static unsigned long clock = 0;
+
+/**
+ * Drop @line from @cache if it is there.
+ */
+static void __invalidate(struct cache *cache, unsigned long line)
+{
+	struct cache_line *set = &cache->lines[(line % cache->nr_sets) * cache->nr_ways];
+	unsigned long tag = line / cache->nr_sets;
+
+	for (unsigned int i = 0; i < cache->nr_ways; i++) {
+		if (set[i].valid && set[i].tag == tag) set[i].valid = false;
+	}
+}
+
+/**
+ * Look up @cache for @line. Fill @line into the set if it is not there, and
+ * back-invalidate the evicted line from the inner levels to keep them
+ * included. Return @true on hit, @false otherwise.
+ */
+static bool __lookup_fill(struct cache *cache, unsigned long line)
+{
+	struct cache_line *set = &cache->lines[(line % cache->nr_sets) * cache->nr_ways];
+	struct cache_line *victim = &set[0];
+	unsigned long tag = line / cache->nr_sets;
+
+	for (unsigned int i = 0; i < cache->nr_ways; i++) {
+		if (set[i].valid && set[i].tag == tag) {
+			set[i].lru = clock;
+			return true;
+		}
+		if (!victim->valid) continue;
+		if (!set[i].valid || set[i].lru < victim->lru) victim = &set[i];
+	}
+
+	if (victim->valid) {
+		unsigned long evicted = victim->tag * cache->nr_sets +
+				(line % cache->nr_sets);
+
+		for (struct cache *inner = caches; inner < cache; inner++) {
+			__invalidate(inner, evicted);
+		}
+	}
+
+	victim->valid = true;
+	victim->tag = tag;
+	victim->lru = clock;
+	return false;
+}
+
+unsigned int access_cache(unsigned long addr, struct cache_stats *stats)
+{
+	unsigned long line = addr >> CACHE_LINE_SHIFT;
+	enum cache_level level;
+	unsigned int cycles;
+
+	clock++;
+
+	for (level = CACHE_L1; level < CACHE_MEMORY; level++) {
+		if (__lookup_fill(&caches[level], line)) break;
+	}
+	cycles = level == CACHE_MEMORY ? MEMORY_CYCLES : caches[level].cycles;
+
+	stats->nr_hits[level]++;
+	stats->cycles += cycles;
+
+	return cycles;
+}
+
+void show_cache_stats(const char *name, struct cache_stats *stats)
+{
+	unsigned long nr_refs = 0;
+
+	for (int i = 0; i < NR_CACHE_LEVELS; i++) {
+		nr_refs += stats->nr_hits[i];
+	}
+
+	fprintf(stderr, "%-9s: %lu refs, L1 %lu, L2 %lu, LLC %lu, memory %lu, "
+			"%lu cycles (%.2f per ref)\n", name, nr_refs,
+			stats->nr_hits[CACHE_L1], stats->nr_hits[CACHE_L2],
+			stats->nr_hits[CACHE_LLC], stats->nr_hits[CACHE_MEMORY],
+			stats->cycles, nr_refs ? (double)stats->cycles / nr_refs : 0.0);
+}
@@ -0,0 +1,78 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "types.h"
+
+#define CACHE_LINE_SHIFT	6
+#define CACHE_LINE_SIZE		(1 << CACHE_LINE_SHIFT)
+
+/**
+ * Geometry and the load-to-use latency (in cycles) of each cache level
+ */
+#define L1_SIZE			(32 << 10)
+#define L1_WAYS			8
+#define L1_CYCLES		4
+
+#define L2_SIZE			(256 << 10)
+#define L2_WAYS			8
+#define L2_CYCLES		12
+
+#define LLC_SIZE		(2 << 20)
+#define LLC_WAYS		16
+#define LLC_CYCLES		40
+
+#define MEMORY_CYCLES		200
+
+enum cache_level {
+	CACHE_L1 = 0,
+	CACHE_L2,
+	CACHE_LLC,
+	CACHE_MEMORY,
+	NR_CACHE_LEVELS,
+};
+
+/**
+ * Statistics of the references through the cache hierarchy
+ */
+struct cache_stats {
+	unsigned long nr_hits[NR_CACHE_LEVELS];	/* Served by each level */
+	unsigned long cycles;
+};
+
+/***********************************************************************
+ * access_cache()
+ *
+ * DESCRIPTION
+ *  Simulate the reference to the cache line containing @addr through the
+ *  L1/L2/LLC hierarchy, and account the result to @stats. The hierarchy is
+ *  inclusive; the line is filled to all levels, evicting the least recently
+ *  used lines.
+ *
+ * RETURN VALUE
+ *  The latency of the reference in cycles
+ */
+unsigned int access_cache(unsigned long addr, struct cache_stats *stats);
+
+/***********************************************************************
+ * show_cache_stats()
+ *
+ * DESCRIPTION
+ *  Print out @stats titled with @name.
+ */
+void show_cache_stats(const char *name, struct cache_stats *stats);
+
+#endif
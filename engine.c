@@ -0,0 +1,1003 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "numa.h"
+#include "engine.h"
+
+/**
+ * Frame of the engine. @count is the reference count in the atomic mode, and
+ * the count folded so far in the split mode.
+ */
+struct engine_frame {
+	long count;
+	bool split;
+};
+
+/**
+ * Object unlinked from the page tables and waiting for the grace period. It is
+ * freed once the global epoch reaches @epoch + 2.
+ */
+struct retired {
+	void *object;
+	unsigned long epoch;
+	struct list_head list;
+};
+
+struct engine_directory {
+	struct pte_directory pd;	/* Must be the first to be on the page table */
+	struct retired retired;
+};
+
+struct engine_process {
+	struct pagetable pagetable;
+	struct retired retired;
+};
+
+struct engine_cpu {
+	struct engine *engine;
+	unsigned int id;
+	pthread_t thread;
+
+	struct engine_process *template;
+	/* Published to the other CPUs, which translate against them */
+	struct engine_process *children[STORM_FORKS_PER_ROUND];
+
+	/* Per-CPU deltas of the reference counts of the split frames */
+	int *deltas;
+
+	/* Free frames of the CPU */
+	unsigned int *free_frames;
+	unsigned int nr_free;
+
+	unsigned long random;
+	unsigned long nr_forks;
+	unsigned long nr_copies;
+	unsigned long nr_reuses;
+	unsigned long nr_translations;
+	bool failed;
+
+	/* Objects retired by the CPU, the oldest first */
+	struct list_head retired;
+	unsigned long nr_retired;
+	unsigned long nr_pending;
+	unsigned long max_pending;
+
+	/* Global epoch observed at the last quiescent state */
+	unsigned long epoch __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct engine {
+	enum refcount_mode mode;
+	unsigned int nr_cpus;
+
+	struct engine_frame *frames;
+	unsigned int nr_frames;
+
+	pthread_barrier_t barrier;
+	struct timespec start;
+
+	unsigned long epoch __attribute__((aligned(64)));
+
+	/* Order of the synchronization events */
+	enum sync_mode sync;
+	struct sync_log *log;
+	pthread_mutex_t sync_lock;
+	unsigned int sync_consumed;	/* Events replayed in the current run */
+	unsigned int sync_position __attribute__((aligned(64)));
+
+	struct engine_cpu cpus[MAX_ENGINE_CPUS];
+};
+
+/* Forking, writes, frees, quiescent state, exit, and quiescent state again */
+#define SYNC_EVENTS_PER_CHILD	(STORM_WRITES_PER_CHILD + STORM_FREES_PER_CHILD + 4)
+
+/**
+ * Each log in the file starts with the magic, the number of CPUs, and the
+ * number of runs, followed by the runs. The numbers are 32-bit little endian
+ * so that the logs can be replayed on any host.
+ */
+#define SYNC_LOG_HEADER_SIZE	12
+
+static const char sync_log_magic[4] = { 'S', 'Y', 'N', 'C' };
+
+static void __put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t __get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static unsigned long __next_random(struct engine_cpu *cpu)
+{
+	/* xorshift64 */
+	cpu->random ^= cpu->random << 13;
+	cpu->random ^= cpu->random >> 7;
+	cpu->random ^= cpu->random << 17;
+	return cpu->random;
+}
+
+static bool __append_sync_run(struct sync_log *log, unsigned int cpu)
+{
+	if (log->nr_runs) {
+		unsigned int *run = &log->runs[log->nr_runs - 1];
+
+		if ((*run >> SYNC_RUN_SHIFT) == cpu && (*run & SYNC_RUN_MAX) < SYNC_RUN_MAX) {
+			(*run)++;
+			return true;
+		}
+	}
+
+	if (log->nr_runs == log->max_runs) {
+		unsigned int max_runs = log->max_runs ? log->max_runs * 2 : 1024;
+		unsigned int *runs = realloc(log->runs, max_runs * sizeof(*runs));
+
+		if (!runs) return false;
+		log->runs = runs;
+		log->max_runs = max_runs;
+	}
+	log->runs[log->nr_runs++] = cpu << SYNC_RUN_SHIFT | 1;
+	return true;
+}
+
+/**
+ * Start a synchronization event of the CPU. The events are serialized to log
+ * their order in the record mode, and wait for the turn of the CPU in the log
+ * in the replay mode.
+ */
+static void __sync_begin(struct engine_cpu *cpu)
+{
+	struct engine *engine = cpu->engine;
+	unsigned int position;
+
+	switch (engine->sync) {
+	case SYNC_RECORD:
+		pthread_mutex_lock(&engine->sync_lock);
+		break;
+	case SYNC_REPLAY:
+		while ((position = __atomic_load_n(&engine->sync_position, __ATOMIC_ACQUIRE)) <
+				engine->log->nr_runs &&
+				engine->log->runs[position] >> SYNC_RUN_SHIFT != cpu->id) {
+			sched_yield();
+		}
+		break;
+	case SYNC_FREE:
+		break;
+	}
+}
+
+static void __sync_end(struct engine_cpu *cpu)
+{
+	struct engine *engine = cpu->engine;
+	unsigned int position;
+
+	switch (engine->sync) {
+	case SYNC_RECORD:
+		if (!__append_sync_run(engine->log, cpu->id)) cpu->failed = true;
+		pthread_mutex_unlock(&engine->sync_lock);
+		break;
+	case SYNC_REPLAY:
+		/* Only the CPU on its turn gets here, and passes the turn on */
+		position = engine->sync_position;
+		if (position >= engine->log->nr_runs) break;
+
+		if (++engine->sync_consumed == (engine->log->runs[position] & SYNC_RUN_MAX)) {
+			engine->sync_consumed = 0;
+			__atomic_store_n(&engine->sync_position, position + 1, __ATOMIC_RELEASE);
+		}
+		break;
+	case SYNC_FREE:
+		break;
+	}
+}
+
+/**
+ * Check whether @log is of @nr_cpus CPUs each running the events of the storm.
+ * The CPUs meet at the barrier at the end of each round, so no CPU can run an
+ * event of a round before all the others have finished the round before it;
+ * a log taking a CPU past it would leave the CPUs waiting for each other.
+ */
+static bool __check_sync_log(struct sync_log *log, unsigned int nr_cpus)
+{
+	const unsigned long nr_round_events = (unsigned long)STORM_FORKS_PER_ROUND *
+			SYNC_EVENTS_PER_CHILD;
+	const unsigned long nr_events = STORM_ROUNDS * nr_round_events;
+	unsigned long events[MAX_ENGINE_CPUS] = { 0 };
+
+	if (log->nr_cpus != nr_cpus) return false;
+
+	for (unsigned int i = 0; i < log->nr_runs; i++) {
+		unsigned int cpu = log->runs[i] >> SYNC_RUN_SHIFT;
+		unsigned long last;
+
+		if (cpu >= nr_cpus) return false;
+		events[cpu] += log->runs[i] & SYNC_RUN_MAX;
+
+		/* The round of the last event of the run */
+		last = (events[cpu] - 1) / nr_round_events;
+		for (unsigned int j = 0; j < nr_cpus; j++) {
+			if (j != cpu && events[j] / nr_round_events < last) return false;
+		}
+	}
+	for (unsigned int i = 0; i < nr_cpus; i++) {
+		if (events[i] != nr_events) return false;
+	}
+	return true;
+}
+
+
+static int __alloc_frame(struct engine_cpu *cpu)
+{
+	unsigned int pfn;
+
+	if (!cpu->nr_free) return -1;
+
+	pfn = cpu->free_frames[--cpu->nr_free];
+	cpu->engine->frames[pfn].count = 1;
+	cpu->engine->frames[pfn].split = false;
+	return pfn;
+}
+
+static void __get_frame(struct engine_cpu *cpu, unsigned int pfn)
+{
+	struct engine *engine = cpu->engine;
+	struct engine_frame *frame = &engine->frames[pfn];
+	long count;
+
+	if (engine->mode == REFCOUNT_SPLIT && __atomic_load_n(&frame->split, __ATOMIC_RELAXED)) {
+		cpu->deltas[pfn]++;
+		return;
+	}
+
+	count = __atomic_add_fetch(&frame->count, 1, __ATOMIC_RELAXED);
+	if (engine->mode == REFCOUNT_SPLIT && count >= SPLIT_THRESHOLD) {
+		__atomic_store_n(&frame->split, true, __ATOMIC_RELAXED);
+	}
+}
+
+static void __put_frame(struct engine_cpu *cpu, unsigned int pfn)
+{
+	struct engine *engine = cpu->engine;
+	struct engine_frame *frame = &engine->frames[pfn];
+
+	if (engine->mode == REFCOUNT_SPLIT && __atomic_load_n(&frame->split, __ATOMIC_RELAXED)) {
+		cpu->deltas[pfn]--;
+		return;
+	}
+
+	if (__atomic_sub_fetch(&frame->count, 1, __ATOMIC_ACQ_REL) == 0) {
+		cpu->free_frames[cpu->nr_free++] = pfn;
+	}
+}
+
+/**
+ * Tell whether the frame is mapped only by the caller. The caller holds a
+ * reference, so nobody else can take a new reference to the frame when the
+ * count is one. The templates of all CPUs map the same frames, so the other
+ * CPUs move the deltas of a split frame at any time, and its count is exact
+ * only at the barrier. With a single CPU, though, the count and the delta of
+ * the caller are the exact count. Otherwise a split frame is taken as shared.
+ */
+static bool __frame_exclusive(struct engine_cpu *cpu, unsigned int pfn)
+{
+	struct engine *engine = cpu->engine;
+	struct engine_frame *frame = &engine->frames[pfn];
+	long count = __atomic_load_n(&frame->count, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&frame->split, __ATOMIC_RELAXED)) {
+		if (engine->nr_cpus > 1) return false;
+		count += __atomic_load_n(&cpu->deltas[pfn], __ATOMIC_RELAXED);
+	}
+	return count == 1;
+}
+
+/**
+ * Fold the per-CPU deltas into the counts of the split frames while all CPUs
+ * wait at the barrier, so the counts are exact here.
+ */
+static void __fold_counts(struct engine *engine, unsigned long *nr_split)
+{
+	*nr_split = 0;
+
+	for (unsigned int pfn = 0; pfn < engine->nr_frames; pfn++) {
+		struct engine_frame *frame = &engine->frames[pfn];
+
+		if (!frame->split) continue;
+
+		for (unsigned int i = 0; i < engine->nr_cpus; i++) {
+			frame->count += engine->cpus[i].deltas[pfn];
+			engine->cpus[i].deltas[pfn] = 0;
+		}
+
+		if (frame->count < SPLIT_THRESHOLD / 2) frame->split = false;
+		if (frame->split) (*nr_split)++;
+
+		if (frame->count == 0) {
+			struct engine_cpu *cpu = &engine->cpus[0];
+
+			cpu->free_frames[cpu->nr_free++] = pfn;
+		}
+	}
+}
+
+
+/**
+ * Retire @retired unlinked from everywhere the other CPUs can find it. The
+ * epoch is read after the unlink, so the CPUs still holding a reference have
+ * not passed a quiescent state in the epoch next to it.
+ */
+static void __retire(struct engine_cpu *cpu, struct retired *retired, void *object)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	retired->object = object;
+	retired->epoch = __atomic_load_n(&cpu->engine->epoch, __ATOMIC_ACQUIRE);
+	list_add_tail(&retired->list, &cpu->retired);
+
+	cpu->nr_retired++;
+	if (++cpu->nr_pending > cpu->max_pending) cpu->max_pending = cpu->nr_pending;
+}
+
+/**
+ * Advance the global epoch from @epoch if all CPUs have observed it
+ */
+static void __advance_epoch(struct engine *engine, unsigned long epoch)
+{
+	for (unsigned int i = 0; i < engine->nr_cpus; i++) {
+		if (__atomic_load_n(&engine->cpus[i].epoch, __ATOMIC_ACQUIRE) != epoch) return;
+	}
+	__atomic_compare_exchange_n(&engine->epoch, &epoch, epoch + 1, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * Announce that the CPU holds no reference to the page tables of the others,
+ * and reclaim the objects retired two epochs ago or earlier.
+ */
+static void __quiescent(struct engine_cpu *cpu)
+{
+	struct engine *engine = cpu->engine;
+	unsigned long epoch = __atomic_load_n(&engine->epoch, __ATOMIC_ACQUIRE);
+
+	/* The translations so far complete before the announcement */
+	__atomic_store_n(&cpu->epoch, epoch, __ATOMIC_RELEASE);
+
+	if (list_empty(&cpu->retired)) return;
+
+	if (list_first_entry(&cpu->retired, struct retired, list)->epoch + 2 > epoch) {
+		__advance_epoch(engine, epoch);
+		epoch = __atomic_load_n(&engine->epoch, __ATOMIC_ACQUIRE);
+	}
+
+	while (!list_empty(&cpu->retired)) {
+		struct retired *retired = list_first_entry(&cpu->retired, struct retired, list);
+
+		if (retired->epoch + 2 > epoch) break;
+
+		list_del(&retired->list);
+		free(retired->object);
+		cpu->nr_pending--;
+	}
+}
+
+/**
+ * Translate @vpn against the page table of @process without any lock. The
+ * directory is loaded with acquire so that its PTEs are seen as initialized,
+ * and the PTE fields with relaxed loads as the owner may update them
+ * meanwhile; neither is a read-modify-write. The directories stay until the
+ * CPU passes a quiescent state even if the owner frees them meanwhile.
+ */
+static bool __translate(struct engine_process *process, unsigned int vpn,
+		unsigned int *pfn)
+{
+	struct pte_directory *pd;
+	struct pte *pte;
+
+	pd = __atomic_load_n(&process->pagetable.outer_ptes[vpn / NR_PTES_PER_PAGE],
+			__ATOMIC_ACQUIRE);
+	if (!pd) return false;
+
+	pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+	if (!__atomic_load_n(&pte->valid, __ATOMIC_RELAXED)) return false;
+
+	*pfn = __atomic_load_n(&pte->pfn, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void __translate_others(struct engine_cpu *cpu)
+{
+	struct engine *engine = cpu->engine;
+
+	for (int i = 0; i < STORM_READS_PER_CHILD; i++) {
+		struct engine_cpu *other = &engine->cpus[__next_random(cpu) % engine->nr_cpus];
+		unsigned long random = __next_random(cpu);
+		struct engine_process *process;
+		unsigned int pfn;
+
+		process = __atomic_load_n(&other->children[random % STORM_FORKS_PER_ROUND],
+				__ATOMIC_ACQUIRE);
+		if (!process) continue;
+
+		if (__translate(process, (random >> 32) % STORM_TEMPLATE_PAGES, &pfn) &&
+				pfn >= engine->nr_frames) {
+			cpu->failed = true;
+		}
+		cpu->nr_translations++;
+	}
+}
+
+
+/**
+ * Drop the references taken for @child so far and free it. The child is not
+ * published yet, so it is freed rather than retired.
+ */
+static void __exit_partial_child(struct engine_cpu *cpu, struct engine_process *child)
+{
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte_directory *pd = child->pagetable.outer_ptes[i];
+
+		if (!pd) continue;
+
+		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			if (pd->ptes[j].valid) __put_frame(cpu, pd->ptes[j].pfn);
+		}
+		free(pd);
+	}
+	free(child);
+}
+
+static struct engine_process *__fork_process(struct engine_cpu *cpu,
+		struct engine_process *parent)
+{
+	struct engine_process *child = calloc(1, sizeof(*child));
+
+	if (!child) return NULL;
+
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte_directory *pd = parent->pagetable.outer_ptes[i];
+		struct pte_directory *new_pd;
+
+		if (!pd) continue;
+
+		new_pd = malloc(sizeof(struct engine_directory));
+		if (!new_pd) {
+			__exit_partial_child(cpu, child);
+			return NULL;
+		}
+
+		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			struct pte *pte = &pd->ptes[j];
+
+			if (!pte->valid) continue;
+			pte->writable = false;
+			__get_frame(cpu, pte->pfn);
+		}
+		*new_pd = *pd;
+		child->pagetable.outer_ptes[i] = new_pd;
+	}
+
+	cpu->nr_forks++;
+	return child;
+}
+
+static bool __write_page(struct engine_cpu *cpu, struct engine_process *process,
+		unsigned int vpn)
+{
+	struct pte_directory *pd = process->pagetable.outer_ptes[vpn / NR_PTES_PER_PAGE];
+	struct pte *pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+	int pfn;
+
+	if (pte->writable) return true;
+
+	if (__frame_exclusive(cpu, pte->pfn)) {
+		pte->writable = true;
+		cpu->nr_reuses++;
+		return true;
+	}
+
+	pfn = __alloc_frame(cpu);
+	if (pfn < 0) return false;
+
+	__put_frame(cpu, pte->pfn);
+	__atomic_store_n(&pte->pfn, pfn, __ATOMIC_RELAXED);
+	pte->writable = true;
+	cpu->nr_copies++;
+	return true;
+}
+
+/**
+ * Unmap @vpn from @process, and free the directory if it becomes empty. The
+ * other CPUs may be translating against the directory, so it is unlinked and
+ * retired rather than freed.
+ */
+static void __free_page(struct engine_cpu *cpu, struct engine_process *process,
+		unsigned int vpn)
+{
+	struct pte_directory **ppd = &process->pagetable.outer_ptes[vpn / NR_PTES_PER_PAGE];
+	struct pte_directory *pd = *ppd;
+	struct pte *pte;
+
+	if (!pd) return;
+
+	pte = &pd->ptes[vpn % NR_PTES_PER_PAGE];
+	if (!pte->valid) return;
+
+	__atomic_store_n(&pte->valid, false, __ATOMIC_RELAXED);
+	__put_frame(cpu, pte->pfn);
+
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (pd->ptes[i].valid) return;
+	}
+
+	__atomic_store_n(ppd, NULL, __ATOMIC_RELEASE);
+	__retire(cpu, &((struct engine_directory *)pd)->retired, pd);
+}
+
+static void __exit_process(struct engine_cpu *cpu, struct engine_process *process)
+{
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte_directory *pd = process->pagetable.outer_ptes[i];
+
+		if (!pd) continue;
+
+		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			if (pd->ptes[j].valid) __put_frame(cpu, pd->ptes[j].pfn);
+		}
+		__retire(cpu, &((struct engine_directory *)pd)->retired, pd);
+	}
+	__retire(cpu, &process->retired, process);
+}
+
+static bool __run_round(struct engine_cpu *cpu)
+{
+	for (int i = 0; i < STORM_FORKS_PER_ROUND; i++) {
+		struct engine_process *child;
+
+		__sync_begin(cpu);
+		child = __fork_process(cpu, cpu->template);
+		if (child) __atomic_store_n(&cpu->children[i], child, __ATOMIC_RELEASE);
+		__sync_end(cpu);
+
+		if (!child) return false;
+	}
+
+	for (int i = 0; i < STORM_FORKS_PER_ROUND; i++) {
+		unsigned int vpn;
+		bool written;
+
+		for (int j = 0; j < STORM_WRITES_PER_CHILD; j++) {
+			vpn = __next_random(cpu) % STORM_TEMPLATE_PAGES;
+
+			__sync_begin(cpu);
+			written = __write_page(cpu, cpu->children[i], vpn);
+			__sync_end(cpu);
+
+			if (!written) return false;
+		}
+
+		vpn = __next_random(cpu) % STORM_TEMPLATE_PAGES;
+		vpn -= vpn % NR_PTES_PER_PAGE;
+		for (int j = 0; j < STORM_FREES_PER_CHILD; j++) {
+			__sync_begin(cpu);
+			__free_page(cpu, cpu->children[i], vpn + j);
+			__sync_end(cpu);
+		}
+
+		__translate_others(cpu);
+
+		__sync_begin(cpu);
+		__quiescent(cpu);
+		__sync_end(cpu);
+	}
+
+	for (int i = 0; i < STORM_FORKS_PER_ROUND; i++) {
+		struct engine_process *child = cpu->children[i];
+
+		__sync_begin(cpu);
+		__atomic_store_n(&cpu->children[i], NULL, __ATOMIC_RELEASE);
+		__exit_process(cpu, child);
+		__sync_end(cpu);
+
+		__sync_begin(cpu);
+		__quiescent(cpu);
+		__sync_end(cpu);
+	}
+	return true;
+}
+
+static void *__run_cpu(void *arg)
+{
+	struct engine_cpu *cpu = arg;
+	struct engine *engine = cpu->engine;
+	unsigned long nr_split;
+
+	/* Allocate the per-CPU state after binding so that it is on the node */
+	bind_numa_node(cpu->id);
+	cpu->deltas = calloc(engine->nr_frames, sizeof(*cpu->deltas));
+	if (!cpu->deltas) cpu->failed = true;
+
+	if (pthread_barrier_wait(&engine->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		clock_gettime(CLOCK_MONOTONIC, &engine->start);
+	}
+	pthread_barrier_wait(&engine->barrier);
+
+	for (int round = 0; round < STORM_ROUNDS; round++) {
+		if (!cpu->failed && !__run_round(cpu)) cpu->failed = true;
+
+		if (pthread_barrier_wait(&engine->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			__fold_counts(engine, &nr_split);
+		}
+		pthread_barrier_wait(&engine->barrier);
+	}
+
+	return NULL;
+}
+
+
+static bool __init_engine(struct engine *engine, unsigned int nr_cpus,
+		enum refcount_mode mode, enum sync_mode sync, struct sync_log *log)
+{
+	const unsigned int frames_per_cpu = STORM_FORKS_PER_ROUND * STORM_WRITES_PER_CHILD;
+	struct engine_process *template;
+
+	memset(engine, 0x00, sizeof(*engine));
+	engine->mode = mode;
+	engine->nr_cpus = nr_cpus;
+	engine->sync = sync;
+	engine->log = log;
+	engine->nr_frames = STORM_TEMPLATE_PAGES + frames_per_cpu * nr_cpus;
+
+	engine->frames = calloc(engine->nr_frames, sizeof(*engine->frames));
+	if (!engine->frames) return false;
+
+	/* The templates of all CPUs map the same frames [0, STORM_TEMPLATE_PAGES) */
+	for (unsigned int i = 0; i < nr_cpus; i++) {
+		struct engine_cpu *cpu = &engine->cpus[i];
+
+		cpu->engine = engine;
+		cpu->id = i;
+		cpu->random = 0x9e3779b97f4a7c15UL * (i + 1);
+		INIT_LIST_HEAD(&cpu->retired);
+
+		cpu->free_frames = calloc(engine->nr_frames, sizeof(*cpu->free_frames));
+		cpu->template = template = calloc(1, sizeof(*template));
+		if (!cpu->free_frames || !template) return false;
+
+		for (unsigned int j = 0; j < frames_per_cpu; j++) {
+			cpu->free_frames[cpu->nr_free++] = STORM_TEMPLATE_PAGES + i * frames_per_cpu + j;
+		}
+
+		for (unsigned int vpn = 0; vpn < STORM_TEMPLATE_PAGES; vpn++) {
+			struct pte_directory **pd = &template->pagetable.outer_ptes[vpn / NR_PTES_PER_PAGE];
+			struct pte *pte;
+
+			if (!*pd && !(*pd = calloc(1, sizeof(**pd)))) return false;
+
+			pte = &(*pd)->ptes[vpn % NR_PTES_PER_PAGE];
+			pte->valid = true;
+			pte->pfn = vpn;
+			pte->private = RW_READ | RW_WRITE;
+			engine->frames[vpn].count++;
+		}
+	}
+
+	for (unsigned int pfn = 0; pfn < STORM_TEMPLATE_PAGES; pfn++) {
+		if (mode == REFCOUNT_SPLIT && engine->frames[pfn].count >= SPLIT_THRESHOLD) {
+			engine->frames[pfn].split = true;
+		}
+	}
+
+	if (pthread_mutex_init(&engine->sync_lock, NULL)) return false;
+	return pthread_barrier_init(&engine->barrier, NULL, nr_cpus) == 0;
+}
+
+/**
+ * Check the counts against the mappings of the templates, which are the only
+ * processes left, and whether all the other frames are free
+ */
+static bool __check_counts(struct engine *engine)
+{
+	unsigned long nr_free = 0;
+
+	for (unsigned int pfn = 0; pfn < engine->nr_frames; pfn++) {
+		long expected = pfn < STORM_TEMPLATE_PAGES ? engine->nr_cpus : 0;
+
+		if (engine->frames[pfn].count != expected) return false;
+	}
+	for (unsigned int i = 0; i < engine->nr_cpus; i++) {
+		nr_free += engine->cpus[i].nr_free;
+	}
+	return nr_free == engine->nr_frames - STORM_TEMPLATE_PAGES;
+}
+
+static void __exit_engine(struct engine *engine)
+{
+	for (unsigned int i = 0; i < engine->nr_cpus; i++) {
+		struct engine_cpu *cpu = &engine->cpus[i];
+
+		/* All CPUs are gone, so the grace periods are over */
+		while (!list_empty(&cpu->retired)) {
+			struct retired *retired = list_first_entry(&cpu->retired, struct retired, list);
+
+			list_del(&retired->list);
+			free(retired->object);
+		}
+
+		if (cpu->template) {
+			for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+				free(cpu->template->pagetable.outer_ptes[j]);
+			}
+			free(cpu->template);
+		}
+		free(cpu->free_frames);
+		free(cpu->deltas);
+	}
+	free(engine->frames);
+	pthread_mutex_destroy(&engine->sync_lock);
+	pthread_barrier_destroy(&engine->barrier);
+}
+
+bool run_fork_storm(unsigned int nr_cpus, enum refcount_mode mode,
+		enum sync_mode sync, struct sync_log *log, struct storm_result *result)
+{
+	struct engine *engine;
+	struct timespec end;
+	unsigned int nr_started = 0;
+	bool failed = false;
+
+	if (!nr_cpus || nr_cpus > MAX_ENGINE_CPUS) return false;
+
+	if (sync == SYNC_RECORD) {
+		log->nr_cpus = nr_cpus;
+		log->nr_runs = 0;
+	} else if (sync == SYNC_REPLAY && !__check_sync_log(log, nr_cpus)) {
+		return false;
+	}
+
+	engine = aligned_alloc(64, sizeof(*engine));
+	if (!engine) return false;
+
+	if (!__init_engine(engine, nr_cpus, mode, sync, log)) {
+		free(engine);
+		return false;
+	}
+
+	for (; nr_started < nr_cpus; nr_started++) {
+		struct engine_cpu *cpu = &engine->cpus[nr_started];
+
+		if (pthread_create(&cpu->thread, NULL, __run_cpu, cpu)) break;
+	}
+	if (nr_started < nr_cpus) {
+		/* The started CPUs would wait at the barrier forever */
+		fprintf(stderr, "Unable to start the CPUs of the engine\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int i = 0; i < nr_cpus; i++) {
+		pthread_join(engine->cpus[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	memset(result, 0x00, sizeof(*result));
+	result->seconds = (end.tv_sec - engine->start.tv_sec) +
+		(end.tv_nsec - engine->start.tv_nsec) / 1e9;
+	for (unsigned int i = 0; i < nr_cpus; i++) {
+		struct engine_cpu *cpu = &engine->cpus[i];
+
+		result->nr_forks += cpu->nr_forks;
+		result->nr_copies += cpu->nr_copies;
+		result->nr_reuses += cpu->nr_reuses;
+		result->nr_translations += cpu->nr_translations;
+		result->nr_retired += cpu->nr_retired;
+		if (cpu->max_pending > result->nr_deferred) result->nr_deferred = cpu->max_pending;
+		failed |= cpu->failed;
+	}
+	for (unsigned int pfn = 0; pfn < engine->nr_frames; pfn++) {
+		if (engine->frames[pfn].split) result->nr_split_frames++;
+	}
+	result->consistent = !failed && __check_counts(engine);
+	result->replayed = sync != SYNC_REPLAY || engine->sync_position == log->nr_runs;
+
+	__exit_engine(engine);
+	free(engine);
+
+	return !failed;
+}
+
+static bool __save_sync_log(FILE *file, struct sync_log *log)
+{
+	unsigned char header[SYNC_LOG_HEADER_SIZE];
+
+	memcpy(header, sync_log_magic, sizeof(sync_log_magic));
+	__put32(header + 4, log->nr_cpus);
+	__put32(header + 8, log->nr_runs);
+	if (fwrite(header, sizeof(header), 1, file) != 1) return false;
+
+	for (unsigned int i = 0; i < log->nr_runs; i++) {
+		unsigned char run[4];
+
+		__put32(run, log->runs[i]);
+		if (fwrite(run, sizeof(run), 1, file) != 1) return false;
+	}
+	return true;
+}
+
+/**
+ * Load the log of @header from @file into @logs. A log cannot have more runs
+ * than the events of its CPUs, which bounds the allocation.
+ */
+static bool __load_sync_log(FILE *file, const unsigned char *header,
+		struct sync_log logs[])
+{
+	unsigned int nr_cpus = __get32(header + 4);
+	unsigned int nr_runs = __get32(header + 8);
+	struct sync_log *log;
+
+	if (memcmp(header, sync_log_magic, sizeof(sync_log_magic)) ||
+			!nr_cpus || nr_cpus > MAX_ENGINE_CPUS ||
+			nr_runs > nr_cpus * STORM_ROUNDS * STORM_FORKS_PER_ROUND * SYNC_EVENTS_PER_CHILD) {
+		return false;
+	}
+
+	log = &logs[nr_cpus];
+	free(log->runs);
+	log->nr_cpus = nr_cpus;
+	log->nr_runs = log->max_runs = nr_runs;
+	log->runs = malloc((nr_runs ? nr_runs : 1) * sizeof(*log->runs));
+	if (!log->runs) return false;
+
+	for (unsigned int i = 0; i < nr_runs; i++) {
+		unsigned char run[4];
+
+		if (fread(run, sizeof(run), 1, file) != 1) return false;
+		log->runs[i] = __get32(run);
+	}
+	return true;
+}
+
+/**
+ * Load the logs in the file at @path into @logs, indexed by the number of
+ * CPUs. Nothing is left loaded on failure.
+ */
+static bool __load_sync_logs(const char *path, struct sync_log logs[])
+{
+	FILE *file = fopen(path, "rb");
+	unsigned char header[SYNC_LOG_HEADER_SIZE];
+	bool ok = true;
+	size_t len;
+
+	if (!file) return false;
+
+	while (ok && (len = fread(header, 1, sizeof(header), file))) {
+		ok = len == sizeof(header) && __load_sync_log(file, header, logs);
+	}
+	if (ferror(file)) ok = false;
+	fclose(file);
+
+	if (!ok) {
+		for (unsigned int i = 0; i <= MAX_ENGINE_CPUS; i++) {
+			free(logs[i].runs);
+			memset(&logs[i], 0x00, sizeof(logs[i]));
+		}
+	}
+	return ok;
+}
+
+bool benchmark_fork_storm(unsigned int max_cpus, enum sync_mode sync,
+		const char *log_path)
+{
+	struct sync_log logs[MAX_ENGINE_CPUS + 1] = { 0 };
+	FILE *file = NULL;
+	bool ok = true;
+
+	if (sync == SYNC_RECORD && !(file = fopen(log_path, "wb"))) {
+		fprintf(stderr, "Unable to create the log file %s\n", log_path);
+		return false;
+	}
+	if (sync == SYNC_REPLAY && !__load_sync_logs(log_path, logs)) {
+		fprintf(stderr, "Unable to load the log file %s\n", log_path);
+		ok = false;
+		goto out;
+	}
+
+	printf("*** Fork storm (%d shared pages, %d forks x %d writes, %d frees, %d reads per CPU per round, %d rounds) ***\n",
+			STORM_TEMPLATE_PAGES, STORM_FORKS_PER_ROUND, STORM_WRITES_PER_CHILD,
+			STORM_FREES_PER_CHILD, STORM_READS_PER_CHILD, STORM_ROUNDS);
+	if (sync != SYNC_FREE) {
+		printf("The events are serialized by the log, which reproduces the counts but "
+				"not the throughputs\n");
+	}
+	printf("%5s %16s %16s %8s %8s %8s %16s %8s %8s\n", "CPUs", "atomic forks/s", "split forks/s",
+			"speedup", "copies", "split", "reads/s", "deferred", "log runs");
+
+	for (unsigned int nr_cpus = 1; ;
+			nr_cpus = nr_cpus * 2 < max_cpus ? nr_cpus * 2 : max_cpus) {
+		struct sync_log *log = &logs[nr_cpus];
+		struct storm_result atomic, split;
+		char runs[16] = "-";
+
+		if (sync == SYNC_REPLAY && !log->nr_cpus) {
+			fprintf(stderr, "No log of %u CPUs in %s\n", nr_cpus, log_path);
+			ok = false;
+			break;
+		}
+		if (sync == SYNC_REPLAY && !__check_sync_log(log, nr_cpus)) {
+			fprintf(stderr, "The log of %u CPUs in %s does not fit the storm\n",
+					nr_cpus, log_path);
+			ok = false;
+			break;
+		}
+		/* The split run replays the order recorded by the atomic run */
+		if (!run_fork_storm(nr_cpus, REFCOUNT_ATOMIC, sync, log, &atomic) ||
+				!run_fork_storm(nr_cpus, REFCOUNT_SPLIT,
+					sync == SYNC_FREE ? SYNC_FREE : SYNC_REPLAY, log, &split)) {
+			fprintf(stderr, "Fork storm on %u CPUs failed\n", nr_cpus);
+			ok = false;
+			break;
+		}
+		if (!atomic.consistent || !split.consistent) {
+			fprintf(stderr, "Reference counts are inconsistent on %u CPUs\n", nr_cpus);
+			ok = false;
+		}
+		if (!atomic.replayed || !split.replayed) {
+			fprintf(stderr, "Replay diverged from the log on %u CPUs\n", nr_cpus);
+			ok = false;
+		}
+		if (sync == SYNC_RECORD && !__save_sync_log(file, log)) {
+			fprintf(stderr, "Unable to save the log of %u CPUs\n", nr_cpus);
+			ok = false;
+		}
+		if (sync != SYNC_FREE) snprintf(runs, sizeof(runs), "%u", log->nr_runs);
+
+		if (sync != SYNC_FREE) {
+			/* The throughputs would measure the serialization of the events */
+			printf("%5u %16s %16s %8s %8lu %8lu %16s %8lu %8s\n", nr_cpus,
+					"-", "-", "-", split.nr_copies, split.nr_split_frames,
+					"-", split.nr_deferred, runs);
+		} else {
+			printf("%5u %16.0f %16.0f %7.2fx %8lu %8lu %16.0f %8lu %8s\n", nr_cpus,
+					atomic.nr_forks / atomic.seconds, split.nr_forks / split.seconds,
+					(split.nr_forks / split.seconds) / (atomic.nr_forks / atomic.seconds),
+					split.nr_copies, split.nr_split_frames,
+					split.nr_translations / split.seconds, split.nr_deferred, runs);
+		}
+
+		if (nr_cpus == max_cpus) break;
+	}
+
+out:
+	if (file) fclose(file);
+	for (unsigned int i = 0; i <= MAX_ENGINE_CPUS; i++) {
+		free(logs[i].runs);
+	}
+	return ok;
+}
@@ -0,0 +1,152 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "types.h"
+
+/**
+ * Concurrent engine running the processes on multiple CPUs (threads). Each CPU
+ * has a template process mapping the same STORM_TEMPLATE_PAGES frames, and
+ * runs fork storms on it in rounds; in a round, the CPU forks
+ * STORM_FORKS_PER_ROUND children from its template, lets each child write to
+ * STORM_WRITES_PER_CHILD pages for copy-on-write and free
+ * STORM_FREES_PER_CHILD pages, emptying a directory, and makes them exit.
+ * Meanwhile, each CPU translates STORM_READS_PER_CHILD VPNs per child against
+ * the page tables of the children of any CPU. The frames of the template end up shared by
+ * hundreds of processes over all CPUs. The CPUs meet at a barrier at the end
+ * of each round.
+ *
+ * The translations walk the page tables with no lock or read-modify-write
+ * instruction, only acquire and relaxed loads, while the owners free the
+ * directories and the processes. The freed objects
+ * are reclaimed with quiescent-state-based reclamation (QSBR); an object is
+ * unlinked first, retired at the current epoch, and freed after the epoch has
+ * advanced twice, by when every CPU has passed a quiescent state (between the
+ * operations on the children) and cannot hold a reference to it anymore. The
+ * epoch advances when all CPUs have observed it.
+ */
+#define MAX_ENGINE_CPUS		64
+
+#define STORM_TEMPLATE_PAGES	128
+#define STORM_FORKS_PER_ROUND	64
+#define STORM_WRITES_PER_CHILD	4
+#define STORM_FREES_PER_CHILD	16	/* From a directory-aligned VPN */
+#define STORM_READS_PER_CHILD	16
+#define STORM_ROUNDS		50
+
+/**
+ * Reference counting of the frames
+ *
+ * - atomic: A single atomic count per frame. Every fork, copy-on-write, and
+ *           exit bounces the cache line of the count between the CPUs
+ * - split : A frame whose count reaches SPLIT_THRESHOLD switches to the
+ *           per-CPU deltas, which each CPU updates without any sharing. The
+ *           deltas are folded into the count at the end of each round, where
+ *           the exact count is known, and the frame switches back to the
+ *           atomic count when the count falls below SPLIT_THRESHOLD / 2. As
+ *           the other CPUs move the deltas meanwhile, copy-on-write copies a
+ *           split frame on multiple CPUs rather than checking whether the
+ *           count is one. On a single CPU, the count and its delta are exact.
+ */
+enum refcount_mode {
+	REFCOUNT_ATOMIC,
+	REFCOUNT_SPLIT,
+};
+
+#define SPLIT_THRESHOLD		64
+
+struct storm_result {
+	double seconds;
+	unsigned long nr_forks;
+	unsigned long nr_copies;	/* Frames copied for copy-on-write */
+	unsigned long nr_reuses;	/* Frames made writable in place */
+	unsigned long nr_split_frames;	/* Frames split at the last fold */
+	unsigned long nr_translations;	/* Lock-free translations */
+	unsigned long nr_retired;	/* Directories and processes retired */
+	unsigned long nr_deferred;	/* Most pending reclamation on a CPU */
+	bool consistent;		/* Counts matched the mappings at the end */
+	bool replayed;			/* Followed the whole log in the replay */
+};
+
+/**
+ * Deterministic record and replay
+ *
+ * The operations of a CPU on the shared state (forking, writing to, freeing,
+ * and exiting the children, and passing quiescent states) are the
+ * synchronization events of the engine. Each CPU runs the same sequence of
+ * the events regardless of the reference counting mode, while their order
+ * over the CPUs depends on the interleaving of the host threads.
+ *
+ * - free  : The CPUs run the events concurrently
+ * - record: The CPUs run the events one at a time, and log the order
+ * - replay: The CPUs run the events in the order of the log, so the copies,
+ *           reuses, split frames, and deferred objects are reproduced exactly,
+ *           even with the other reference counting mode
+ *
+ * The log is run-length encoded; each run has the CPU in the bits above
+ * SYNC_RUN_SHIFT and the number of consecutive events of the CPU below.
+ */
+enum sync_mode {
+	SYNC_FREE,
+	SYNC_RECORD,
+	SYNC_REPLAY,
+};
+
+#define SYNC_RUN_SHIFT		24
+#define SYNC_RUN_MAX		((1U << SYNC_RUN_SHIFT) - 1)
+
+struct sync_log {
+	unsigned int nr_cpus;
+	unsigned int nr_runs;
+	unsigned int max_runs;
+	unsigned int *runs;
+};
+
+/***********************************************************************
+ * run_fork_storm()
+ *
+ * DESCRIPTION
+ *  Run the fork storms on @nr_cpus CPUs with @mode reference counting. The
+ *  order of the synchronization events is recorded into @log in the @sync
+ *  record mode, and follows @log in the replay mode. @log is not used in the
+ *  free mode.
+ *
+ * RETURN VALUE
+ *  Return @true on success, with the result in @result
+ *  Return @false if unable to set up the engine, or if @log does not fit
+ */
+bool run_fork_storm(unsigned int nr_cpus, enum refcount_mode mode,
+		enum sync_mode sync, struct sync_log *log, struct storm_result *result);
+
+/***********************************************************************
+ * benchmark_fork_storm()
+ *
+ * DESCRIPTION
+ *  Run the fork storms with both reference counting modes on 1, 2, 4, ...,
+ *  @max_cpus CPUs, and report the throughputs. In the @sync record mode, the
+ *  atomic runs are recorded into the log file at @log_path, and the split
+ *  runs replay them. In the replay mode, both runs replay the logs from the
+ *  file. The log reproduces the counts (copies, split frames, and deferred
+ *  objects) but not the throughputs, which are not reported in either mode
+ *  as the events are serialized. Compare the throughputs with the free runs.
+ *
+ * RETURN VALUE
+ *  Return @true if all runs succeeded with the consistent counts
+ */
+bool benchmark_fork_storm(unsigned int max_cpus, enum sync_mode sync,
+		const char *log_path);
+
+#endif
@@ -0,0 +1,155 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "types.h"
+#include "numa.h"
+
+#define MPOL_PREFERRED	1
+
+/* The number of pages to query the placement at once */
+#define NR_QUERY_PAGES	512
+
+static struct numa_node {
+	int id;
+	cpu_set_t cpus;
+} nodes[MAX_NUMA_NODES];
+static unsigned int nr_nodes = 0;
+
+/**
+ * Parse the CPU list of sysfs such as "0-3,8-11" into @cpus
+ */
+static bool __parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+
+	while (*list && *list != '\n') {
+		char *end;
+		unsigned long first = strtoul(list, &end, 10);
+		unsigned long last = first;
+
+		if (end == list) return false;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list) return false;
+		}
+		for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, cpus);
+		}
+		list = (*end == ',') ? end + 1 : end;
+	}
+	return CPU_COUNT(cpus) > 0;
+}
+
+unsigned int init_numa(void)
+{
+	char path[64];
+	char list[1024];
+
+	if (nr_nodes) return nr_nodes;
+
+	for (int id = 0; id < MAX_NUMA_NODES * 4 && nr_nodes < MAX_NUMA_NODES; id++) {
+		FILE *file;
+		bool parsed;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+		if (!(file = fopen(path, "r"))) continue;
+
+		parsed = fgets(list, sizeof(list), file) &&
+				__parse_cpulist(list, &nodes[nr_nodes].cpus);
+		fclose(file);
+
+		/* Memory-only nodes cannot run the workers */
+		if (!parsed) continue;
+		nodes[nr_nodes++].id = id;
+	}
+
+	/* No NUMA. Pretend a single node with all CPUs we can run on */
+	if (!nr_nodes) {
+		nodes[0].id = 0;
+		if (sched_getaffinity(0, sizeof(nodes[0].cpus), &nodes[0].cpus) < 0) {
+			CPU_ZERO(&nodes[0].cpus);
+		}
+		nr_nodes = 1;
+	}
+	return nr_nodes;
+}
+
+int bind_numa_node(unsigned int index)
+{
+	struct numa_node *node;
+	unsigned long mask[MAX_NUMA_NODES * 4 / (sizeof(unsigned long) * 8)] = { 0 };
+
+	init_numa();
+	node = &nodes[index % nr_nodes];
+
+	if (CPU_COUNT(&node->cpus) &&
+			sched_setaffinity(0, sizeof(node->cpus), &node->cpus) < 0) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+
+	/**
+	 * Prefer the node rather than binding to it, so that the allocation can
+	 * still go to the other nodes when the node runs out of memory. This
+	 * fails on the hosts without NUMA support, where the placement does not
+	 * matter anyway.
+	 */
+	mask[node->id / (sizeof(unsigned long) * 8)] |=
+			1UL << (node->id % (sizeof(unsigned long) * 8));
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			(unsigned long)sizeof(mask) * 8 + 1);
+
+	return node->id;
+}
+
+bool count_remote_pages(void *start, size_t size, int node,
+		unsigned long *nr_pages, unsigned long *nr_remote)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *pages[NR_QUERY_PAGES];
+	int status[NR_QUERY_PAGES];
+	unsigned long addr = (unsigned long)start & ~(page_size - 1);
+	unsigned long end = (unsigned long)start + size;
+
+	*nr_pages = *nr_remote = 0;
+
+	while (addr < end) {
+		unsigned long nr = 0;
+
+		for (; nr < NR_QUERY_PAGES && addr < end; nr++, addr += page_size) {
+			pages[nr] = (void *)addr;
+		}
+
+		/* With no target nodes, move_pages() tells where the pages are */
+		if (syscall(SYS_move_pages, 0, nr, pages, NULL, status, 0) < 0) {
+			return false;
+		}
+
+		for (unsigned long i = 0; i < nr; i++) {
+			if (status[i] < 0) continue;	/* Not resident */
+			(*nr_pages)++;
+			if (status[i] != node) (*nr_remote)++;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,72 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * NUMA placement of the simulator workers. Each worker is pinned to the CPUs
+ * of a host node and allocates its state from the memory of the node, so that
+ * the workers do not reach the memory of the other nodes. The host topology
+ * is read from sysfs, and the memory policy is set through the system calls
+ * directly so that the simulator does not depend on libnuma. On a host
+ * without NUMA, there is a single node holding all CPUs.
+ */
+#define MAX_NUMA_NODES	64
+
+/***********************************************************************
+ * init_numa()
+ *
+ * DESCRIPTION
+ *  Discover the nodes of the host that have CPUs.
+ *
+ * RETURN VALUE
+ *  Return the number of the nodes, which is at least 1
+ */
+unsigned int init_numa(void);
+
+/***********************************************************************
+ * bind_numa_node()
+ *
+ * DESCRIPTION
+ *  Pin the calling thread to the CPUs of the @index-th node, and make the
+ *  thread prefer the memory of the node for the pages it touches from now on.
+ *  @index wraps around the nodes, so the workers can be spread over the nodes
+ *  by their worker numbers.
+ *
+ * RETURN VALUE
+ *  Return the node id the thread is bound to
+ *  Return -1 if unable to bind the thread
+ */
+int bind_numa_node(unsigned int index);
+
+/***********************************************************************
+ * count_remote_pages()
+ *
+ * DESCRIPTION
+ *  Query the nodes holding the resident pages in [@start, @start + @size),
+ *  and count the pages and those of them on the nodes other than @node.
+ *
+ * RETURN VALUE
+ *  Return @true on success
+ *  Return @false if the host does not tell the page placement
+ */
+bool count_remote_pages(void *start, size_t size, int node,
+		unsigned long *nr_pages, unsigned long *nr_remote);
+
+#endif
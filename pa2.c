@@ -15,11 +15,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include "types.h"
 #include "list_head.h"
 #include "vm.h"
+#include "arena.h"
 
 /**
  * Ready queue of the system
@@ -38,10 +40,416 @@ extern struct pagetable *ptbr;
 
 
 /**
- * The number of mappings for each page frame. Can be used to determine how
- * many processes are using the page frames.
+ * Descriptors of the page frames. page_mapcount() of each frame can be used to
+ * determine how many processes are using the page frame. The array is resized
+ * as the page frames are added or removed at runtime.
  */
-extern unsigned int mapcounts[];
+extern struct page *mem_map;
+extern unsigned int nr_pageframes;
+
+/**
+ * Guests on the system, and the frames surrendered to the host by inflating
+ * the balloons of guests.
+ */
+extern struct list_head guests;
+extern unsigned int nr_balloon_frames;
+
+/**
+ * Page coloring policy of the allocator, and the number of allocations that
+ * could not get a frame of the preferred colors.
+ */
+extern enum page_coloring page_coloring;
+extern unsigned long nr_color_fallbacks;
+
+/**
+ * Overcommit policy, the number of pages charged to the commit, and the
+ * number of requests refused by the policy
+ */
+extern enum overcommit_policy overcommit_policy;
+extern unsigned long nr_committed_pages;
+extern unsigned long nr_commit_refusals;
+
+/**
+ * The number of pages copied for copy-on-write
+ */
+extern unsigned long nr_copied_pages;
+
+
+/**
+ * Page frames are grouped by their colors to find a free frame of a color
+ * quickly. Bit k in frames_in_use[c] stands for the frame with pfn
+ * (k * NR_CACHE_COLORS + c), and it is set while the frame is allocated or
+ * offline. The bitmaps grow by words as page frames are added.
+ */
+#define BITS_PER_WORD		64
+
+static unsigned long long *frames_in_use[NR_CACHE_COLORS] = { NULL };
+static unsigned int nr_color_words = 0;
+
+/**
+ * Reverse mapping of a page frame. The PTEs mapping the frame are chained
+ * from @rmap of the frame.
+ */
+struct rmap_item {
+	struct process *process;
+	unsigned int vpn;
+	struct rmap_item *next;
+};
+
+static void __add_rmap(unsigned int pfn, struct process *process, unsigned int vpn)
+{
+	struct rmap_item *item = arena_malloc(sizeof(*item));
+
+	item->process = process;
+	item->vpn = vpn;
+	item->next = mem_map[pfn].rmap;
+	mem_map[pfn].rmap = item;
+}
+
+static void __del_rmap(unsigned int pfn, struct process *process, unsigned int vpn)
+{
+	for (struct rmap_item **pos = &mem_map[pfn].rmap; *pos; pos = &(*pos)->next) {
+		struct rmap_item *item = *pos;
+
+		if (item->process == process && item->vpn == vpn) {
+			*pos = item->next;
+			arena_free(item);
+			return;
+		}
+	}
+}
+
+static void __set_frame_in_use(unsigned int pfn, bool in_use)
+{
+	unsigned int k = pfn / NR_CACHE_COLORS;
+	unsigned long long *word = &frames_in_use[pfn % NR_CACHE_COLORS][k / BITS_PER_WORD];
+
+	if (in_use) {
+		*word |= 1ULL << (k % BITS_PER_WORD);
+	} else {
+		*word &= ~(1ULL << (k % BITS_PER_WORD));
+	}
+}
+
+/**
+ * __find_free_frame(@color)
+ *
+ * RETURN
+ *   The smallest pfn of the free frames of @color
+ *   -1 if all frames of @color are allocated
+ */
+static int __find_free_frame(unsigned int color)
+{
+	for (int i = 0; i < nr_color_words; i++) {
+		unsigned long long free = ~frames_in_use[color][i];
+		unsigned int pfn;
+
+		if (!free) continue;
+
+		pfn = (i * BITS_PER_WORD + __builtin_ctzll(free)) * NR_CACHE_COLORS + color;
+		if (pfn >= nr_pageframes) break;
+
+		return pfn;
+	}
+	return -1;
+}
+
+/**
+ * __find_free_frame_in(@first_color, @nr_colors)
+ *
+ * RETURN
+ *   The smallest pfn of the free frames of the colors in [@first_color,
+ *   @first_color + @nr_colors)
+ *   -1 if no frame is available for the colors
+ */
+static int __find_free_frame_in(unsigned int first_color, unsigned int nr_colors)
+{
+	int pfn = -1;
+
+	for (unsigned int c = first_color; c < first_color + nr_colors; c++) {
+		int candidate = __find_free_frame(c);
+
+		if (candidate >= 0 && (pfn < 0 || candidate < pfn)) pfn = candidate;
+	}
+	return pfn;
+}
+
+/**
+ * __alloc_frame(@vpn)
+ *
+ * DESCRIPTION
+ *   Pick a free page frame to map @vpn of @current according to
+ *   @page_coloring, and mark it in use. Fall back to the smallest free pfn
+ *   when the preferred colors are exhausted.
+ *
+ * RETURN
+ *   The pfn of the allocated frame
+ *   -1 if all page frames are allocated
+ */
+static int __alloc_frame(unsigned int vpn)
+{
+	const unsigned int colors_per_partition = NR_CACHE_COLORS / NR_COLOR_PARTITIONS;
+	int pfn = -1;
+
+	struct guest *guest = current->guest;
+
+	// the guest cannot use more frames than its balloon leaves
+	if (guest && (int)guest->nr_used >= (int)guest->nr_frames - guest->balloon)
+		return -1;
+
+	switch (page_coloring) {
+	case COLORING_VPN:
+		pfn = __find_free_frame(vpn % NR_CACHE_COLORS);
+		break;
+	case COLORING_PROCESS:
+		pfn = __find_free_frame_in(
+				(current->pid % NR_COLOR_PARTITIONS) * colors_per_partition,
+				colors_per_partition);
+		break;
+	case COLORING_NONE:
+	default:
+		break;
+	}
+
+	if (pfn < 0) {
+		pfn = __find_free_frame_in(0, NR_CACHE_COLORS);
+		if (pfn >= 0 && page_coloring != COLORING_NONE) nr_color_fallbacks++;
+	}
+
+	if (pfn >= 0) {
+		__set_frame_in_use(pfn, true);
+		mem_map[pfn].owner = guest;
+		if (guest) guest->nr_used++;
+	}
+	return pfn;
+}
+
+static void __uncharge_frame(unsigned int pfn)
+{
+	if (mem_map[pfn].owner) mem_map[pfn].owner->nr_used--;
+	mem_map[pfn].owner = NULL;
+}
+
+/**
+ * __free_frame(@pfn)
+ *
+ * DESCRIPTION
+ *   Return the frame @pfn that is no longer mapped to the free frames.
+ */
+static void __free_frame(unsigned int pfn)
+{
+	__uncharge_frame(pfn);
+	__set_frame_in_use(pfn, false);
+}
+
+
+/**
+ * __update_contig_hint(@pd, @pte_index)
+ *
+ * DESCRIPTION
+ *   Recompute the contiguous hint for the naturally aligned group of
+ *   NR_CONTIG_PTES that contains @pte_index. The hint is set only when all
+ *   PTEs in the group are valid, have the same permission, and map the
+ *   naturally aligned consecutive page frames. Should be called whenever
+ *   a PTE in @pd is changed.
+ */
+static void __update_contig_hint(struct pte_directory *pd, unsigned int pte_index)
+{
+	struct pte *ptes = &pd->ptes[pte_index & ~(NR_CONTIG_PTES - 1)];
+	bool contig = ptes[0].valid && (ptes[0].pfn % NR_CONTIG_PTES == 0);
+	int i;
+
+	for (i = 1; i < NR_CONTIG_PTES && contig; i++) {
+		if (!ptes[i].valid ||
+				ptes[i].pfn != ptes[0].pfn + i ||
+				ptes[i].writable != ptes[0].writable ||
+				ptes[i].private != ptes[0].private) {
+			contig = false;
+		}
+	}
+
+	for (i = 0; i < NR_CONTIG_PTES; i++) {
+		ptes[i].contig = contig;
+	}
+}
+
+
+/**
+ * __lookup_pte(@pt, @vpn)
+ *
+ * DESCRIPTION
+ *   Find the PTE for @vpn in @pt.
+ *
+ * RETURN
+ *   The valid PTE for @vpn
+ *   NULL if @vpn is not mapped
+ */
+static struct pte *__lookup_pte(struct pagetable *pt, unsigned int vpn)
+{
+	struct pte_directory *pd;
+
+	if (vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) return NULL;
+
+	pd = pt->outer_ptes[vpn / NR_PTES_PER_PAGE];
+	if (!pd || !pd->ptes[vpn % NR_PTES_PER_PAGE].valid) return NULL;
+
+	return &pd->ptes[vpn % NR_PTES_PER_PAGE];
+}
+
+static bool __pte_continues(struct pte *prev, struct pte *next)
+{
+	return prev && next &&
+		next->pfn == prev->pfn + 1 &&
+		next->writable == prev->writable &&
+		next->private == prev->private;
+}
+
+/**
+ * __rebuild_range(@pt, @vpn)
+ *
+ * DESCRIPTION
+ *   Find the longest run of the contiguous PTEs around @vpn, and install the
+ *   range translation for the run if it is long enough. The ranges
+ *   overlapping the run are replaced with the new one. When the range table
+ *   is full, the shortest range gives its slot to a longer run.
+ */
+static void __rebuild_range(struct pagetable *pt, unsigned int vpn)
+{
+	struct pte *pte = __lookup_pte(pt, vpn);
+	struct range_translation *slot = NULL;
+	unsigned int base = vpn, limit = vpn + 1;
+	int i;
+
+	if (!pte) return;
+
+	while (base > 0 && __pte_continues(__lookup_pte(pt, base - 1),
+				__lookup_pte(pt, base))) base--;
+	while (__pte_continues(__lookup_pte(pt, limit - 1),
+				__lookup_pte(pt, limit))) limit++;
+
+	for (i = 0; i < NR_RANGE_TRANSLATIONS; i++) {
+		struct range_translation *r = &pt->ranges[i];
+
+		if (r->valid && r->base < limit && base < r->limit) {
+			r->valid = false;
+		}
+	}
+
+	if (limit - base < MIN_RANGE_PAGES) return;
+
+	for (i = 0; i < NR_RANGE_TRANSLATIONS; i++) {
+		struct range_translation *r = &pt->ranges[i];
+
+		if (!r->valid) {
+			slot = r;
+			break;
+		}
+		if (!slot || r->limit - r->base < slot->limit - slot->base) slot = r;
+	}
+	if (slot->valid && slot->limit - slot->base >= limit - base) return;
+
+	slot->valid = true;
+	slot->writable = pte->writable;
+	slot->base = base;
+	slot->limit = limit;
+	slot->offset = pte->pfn - vpn;
+}
+
+/**
+ * __update_range(@pt, @vpn)
+ *
+ * DESCRIPTION
+ *   Keep the range translations in @pt consistent with the PTEs. Should be
+ *   called whenever the PTE for @vpn is changed.
+ */
+static void __update_range(struct pagetable *pt, unsigned int vpn)
+{
+	for (int i = 0; i < NR_RANGE_TRANSLATIONS; i++) {
+		struct range_translation *r = &pt->ranges[i];
+
+		if (r->valid && vpn >= r->base && vpn < r->limit) {
+			r->valid = false;
+		}
+	}
+
+	if (vpn > 0) __rebuild_range(pt, vpn - 1);
+	__rebuild_range(pt, vpn);
+	__rebuild_range(pt, vpn + 1);
+}
+
+
+/**
+ * __may_commit(@nr_pages)
+ *
+ * DESCRIPTION
+ *   Check whether @nr_pages can be charged to the commit under
+ *   @overcommit_policy. The strict policy refuses the request exceeding the
+ *   commit limit, whereas the heuristic one refuses the request larger than
+ *   the whole page frames only.
+ */
+static bool __may_commit(unsigned long nr_pages)
+{
+	unsigned long limit = (unsigned long)nr_pageframes * OVERCOMMIT_RATIO / 100;
+	bool allowed;
+
+	if (overcommit_policy == OVERCOMMIT_STRICT) {
+		allowed = nr_committed_pages + nr_pages <= limit;
+	} else {
+		allowed = nr_pages <= nr_pageframes;
+	}
+
+	if (!allowed) nr_commit_refusals++;
+	return allowed;
+}
+
+static void __charge_commit(struct process *p, unsigned int nr_pages)
+{
+	p->nr_committed += nr_pages;
+	nr_committed_pages += nr_pages;
+}
+
+static void __uncharge_commit(struct process *p, unsigned int nr_pages)
+{
+	p->nr_committed -= nr_pages;
+	nr_committed_pages -= nr_pages;
+}
+
+static inline bool __pte_committed(struct pte *pte)
+{
+	return pte->private & RW_WRITE;
+}
+
+
+/**
+ * __unmap_pte(@pt, @vpn)
+ *
+ * DESCRIPTION
+ *   Clear the PTE for @vpn in @pt, and free the page directory if it becomes
+ *   empty. The caller should take care of the mapcount and rmap of the frame.
+ */
+static void __unmap_pte(struct pagetable *pt, unsigned int vpn)
+{
+	unsigned int pd_index = vpn/NR_PTES_PER_PAGE;
+	unsigned int pte_index = vpn%NR_PTES_PER_PAGE;
+	struct pte_directory *pd = pt->outer_ptes[pd_index];
+	int i;
+
+	pd->ptes[pte_index].valid=false;
+	pd->ptes[pte_index].writable=false;
+	pd->ptes[pte_index].pfn=0;
+	pd->ptes[pte_index].private=0;
+	__update_contig_hint(pd, pte_index);
+
+	// if second-level page table is empty, then free that table
+	for(i=0; i<NR_PTES_PER_PAGE && !(pd->ptes[i].valid); i++);
+	// all ptes are invalid, then free that page table
+	if(i==NR_PTES_PER_PAGE){
+		pt->outer_ptes[pd_index]=NULL;
+		arena_free(pd);
+	}
+
+	__update_range(pt, vpn);
+}
 
 
 /**
@@ -65,34 +473,46 @@ unsigned int alloc_page(unsigned int vpn, unsigned int rw)
 	// 
 	unsigned int pd_index = vpn/NR_PTES_PER_PAGE;
 	unsigned int pte_index = vpn%NR_PTES_PER_PAGE;
+
+	// vpn beyond the page table; outer_ptes[] would overflow into ranges[]
+	if(vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE)
+		return -1;
+
+	// writable pages are charged to the commit
+	bool commit = (rw & RW_WRITE);
+	if(commit && !__may_commit(1))
+		return -1;
 	
 	// is page table valid?
 	// page table doesn't exist!
 	if(current->pagetable.outer_ptes[pd_index] == NULL){
-		struct pte_directory *new_pd = malloc(sizeof(struct pte_directory));
+		struct pte_directory *new_pd = arena_calloc(1, sizeof(struct pte_directory));
 		current->pagetable.outer_ptes[pd_index]=new_pd;
 		//printf("current page table is empty. fill the page with next level page table(16 ptes).\n");
 	}
 	
-	int i=0;
-	for(i=0; i<NR_PAGEFRAMES; i++){
-		// find the empty page frame of smallest #
-		if(mapcounts[i]==0){
-			// mapping vpn-pfn
-			mapcounts[i]++;
-
-			// record on pte
-			current->pagetable.outer_ptes[pd_index]->ptes[pte_index].valid = true;
-			if(rw==(RW_READ|RW_WRITE))
-				current->pagetable.outer_ptes[pd_index]->ptes[pte_index].writable = true;
-			else
-				current->pagetable.outer_ptes[pd_index]->ptes[pte_index].writable = false;
-			current->pagetable.outer_ptes[pd_index]->ptes[pte_index].pfn = i;
-			current->pagetable.outer_ptes[pd_index]->ptes[pte_index].private = rw;
-
-			return i;
-		}
-	}	
+	// find the empty page frame of smallest # (or of the preferred color)
+	int i = __alloc_frame(vpn);
+	if(i >= 0){
+		// mapping vpn-pfn
+		page_mapcount_inc(i);
+		__add_rmap(i, current, vpn);
+
+		// record on pte
+		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].valid = true;
+		if(rw==(RW_READ|RW_WRITE))
+			current->pagetable.outer_ptes[pd_index]->ptes[pte_index].writable = true;
+		else
+			current->pagetable.outer_ptes[pd_index]->ptes[pte_index].writable = false;
+		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].pfn = i;
+		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].private = rw;
+		__update_contig_hint(current->pagetable.outer_ptes[pd_index], pte_index);
+		__update_range(&current->pagetable, vpn);
+		if(commit)
+			__charge_commit(current, 1);
+
+		return i;
+	}
 	return -1;
 }
 
@@ -112,33 +532,23 @@ void free_page(unsigned int vpn)
 	unsigned int pte_index = vpn%NR_PTES_PER_PAGE;
 
 	unsigned int pfn = current->pagetable.outer_ptes[pd_index]->ptes[pte_index].pfn;
-	int process_cnt = mapcounts[pfn];	// the number of processes that refer to page frame #pfn
+	int process_cnt = page_mapcount(pfn);	// the number of processes that refer to page frame #pfn
 	
 	// nothing to free
 	if(process_cnt==0){
 		return;
 	}
+
 	// something to free
-	else{
-		mapcounts[pfn]--;
-		
-		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].valid=false;
-		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].writable=false;
-		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].pfn=0;
-		current->pagetable.outer_ptes[pd_index]->ptes[pte_index].private=0;
-	}
+	page_mapcount_dec(pfn);
+	if(page_mapcount(pfn)==0)
+		__free_frame(pfn);
+	__del_rmap(pfn, current, vpn);
 
-	// if second-level page table is empty, then free that table
-	int i;
-	// find valid pte
-	for(i=0; i<NR_PTES_PER_PAGE && !(current->pagetable.outer_ptes[pd_index]->ptes[i].valid); i++);
-	// all ptes are invalid, then free that page table
-	if(i==NR_PTES_PER_PAGE){
-		struct pte_directory *p_pte_dir = current->pagetable.outer_ptes[pd_index];
-		current->pagetable.outer_ptes[pd_index]=NULL;
-		free(p_pte_dir);
-	}
-	
+	if(__pte_committed(&current->pagetable.outer_ptes[pd_index]->ptes[pte_index]))
+		__uncharge_commit(current, 1);
+
+	__unmap_pte(&current->pagetable, vpn);
 }
 
 /**
@@ -171,7 +581,7 @@ bool handle_page_fault(unsigned int vpn, unsigned int rw)
 	struct pte *pte;
 
 	// case 1
-	if(!pt)
+	if(!pt || vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE)
 		return false;
 
 	pd=pt->outer_ptes[pd_index];
@@ -196,30 +606,35 @@ bool handle_page_fault(unsigned int vpn, unsigned int rw)
 	
 	// case 2
 	int pfn = pte->pfn;
-	// check the # of processes that refer to PA(mapcounts)
-	int number_of_process = mapcounts[pfn];
+	// check the # of processes that refer to PA(mapcount)
+	int number_of_process = page_mapcount(pfn);
 	
 	// only one process refer to PA[pfn]
 	if(number_of_process==1){
 		pte->writable=true;
+		__update_contig_hint(pd, pte_index);
+		__update_range(pt, vpn);
 		return true;
 	}
 	// many
 	else if(number_of_process>1) {
 		// new allocation
-		int i;
-		for(i=0; i<NR_PAGEFRAMES; i++){
-			if(mapcounts[i]==0){
-				int old_pfn = pte->pfn;
-				mapcounts[pfn]--;
-
-				mapcounts[i]++;
-
-				pte->writable = true;
-				pte->pfn = i;
-				
-				return true;
-			}
+		int i = __alloc_frame(vpn);
+		if(i >= 0){
+			int old_pfn = pte->pfn;
+			page_mapcount_dec(pfn);
+			__del_rmap(old_pfn, current, vpn);
+
+			page_mapcount_inc(i);
+			__add_rmap(i, current, vpn);
+
+			pte->writable = true;
+			pte->pfn = i;
+			nr_copied_pages++;
+			__update_contig_hint(pd, pte_index);
+			__update_range(pt, vpn);
+			
+			return true;
 		}
 	}
 
@@ -240,8 +655,8 @@ bool handle_page_fault(unsigned int vpn, unsigned int rw)
  *   the identical page table entry 'values' to its parent's (i.e., @current)
  *   page table. 
  *   To implement the copy-on-write feature, you should manipulate the writable
- *   bit in PTE and mapcounts for shared pages. You can use pte->private to
- *   remember whether the PTE was originally writable or not.
+ *   bit in PTE and page_mapcount() of the frames for shared pages. You can use
+ *   pte->private to remember whether the PTE was originally writable or not.
  */
 void switch_process(unsigned int pid)
 {
@@ -260,17 +675,20 @@ void switch_process(unsigned int pid)
 			// chage current process and processes list head
 			current = p;
 			ptbr = &p->pagetable;
-			processes.next = p->list.next;
-			processes.prev = p->list.prev;
 			return;
 		}
 	}
 
 	// the process that i want doesn't exist
-	// fork
-	p = malloc(sizeof(*p));		/* This example shows to create a process, */
+	// fork; the writable pages of the parent may be copied on write later
+	if(!__may_commit(current->nr_committed))
+		return;
+
+	p = arena_calloc(1, sizeof(*p));	/* This example shows to create a process, */
 	
 	p->pid = pid;
+	p->guest = current->guest;	// the child belongs to the guest of the parent
+	__charge_commit(p, current->nr_committed);
 	
 	int i, j;
 	struct pagetable *old_pt;
@@ -283,7 +701,7 @@ void switch_process(unsigned int pid)
 	for(i=0; i<NR_PTES_PER_PAGE; i++){
 		old_pd = old_pt->outer_ptes[i];
 		if(old_pd != NULL){
-			struct pte_directory *newpd = malloc(sizeof(struct pte_directory));
+			struct pte_directory *newpd = arena_calloc(1, sizeof(struct pte_directory));
 			newpt->outer_ptes[i] = newpd;
 
 			for(j=0; j<NR_PTES_PER_PAGE; j++){
@@ -295,15 +713,27 @@ void switch_process(unsigned int pid)
 					newpd->ptes[j].writable=false;
 					
 					newpd->ptes[j].pfn = old_pte->pfn;
-					mapcounts[old_pte->pfn]++;
+					page_mapcount_inc(old_pte->pfn);
+					__add_rmap(old_pte->pfn, p, i*NR_PTES_PER_PAGE + j);
 					newpd->ptes[j].private = old_pte->private;
 				}
 			}
 
+			// writable is cleared on both sides; recompute the contig hints
+			for(j=0; j<NR_PTES_PER_PAGE; j+=NR_CONTIG_PTES){
+				__update_contig_hint(old_pd, j);
+				__update_contig_hint(newpd, j);
+			}
+
 		}
 
 	}
 
+	// range translations are shared as read-only as well
+	for(i=0; i<NR_RANGE_TRANSLATIONS; i++){
+		old_pt->ranges[i].writable=false;
+		newpt->ranges[i]=old_pt->ranges[i];
+	}
 
 	current = p;
 	ptbr = &p->pagetable;
@@ -312,3 +742,247 @@ void switch_process(unsigned int pid)
 								/* and add it to the @processes list */
 }
 
+
+
+/**
+ * __resize_frame_metadata(@nr_frames)
+ *
+ * DESCRIPTION
+ *   Resize the per-frame metadata to hold @nr_frames page frames. The
+ *   metadata for the frames beyond the current frame space are cleared.
+ *
+ * RETURN
+ *   @true on success
+ *   @false if unable to allocate the metadata
+ */
+static bool __resize_frame_metadata(unsigned int nr_frames)
+{
+	const unsigned int frames_per_word = NR_CACHE_COLORS * BITS_PER_WORD;
+	unsigned int nr_words = (nr_frames + frames_per_word - 1) / frames_per_word;
+	unsigned int nr_entries = nr_frames ? nr_frames : 1;
+	void *p;
+
+	if (!(p = arena_realloc(mem_map, sizeof(*mem_map) * nr_entries))) return false;
+	mem_map = p;
+
+	for (unsigned int c = 0; c < NR_CACHE_COLORS; c++) {
+		if (!(p = arena_realloc(frames_in_use[c], sizeof(**frames_in_use) * (nr_words ? nr_words : 1)))) {
+			return false;
+		}
+		frames_in_use[c] = p;
+
+		for (unsigned int i = nr_color_words; i < nr_words; i++) {
+			frames_in_use[c][i] = 0;
+		}
+	}
+	nr_color_words = nr_words;
+
+	for (unsigned int pfn = nr_pageframes; pfn < nr_frames; pfn++) {
+		memset(&mem_map[pfn], 0x00, sizeof(*mem_map));
+		__set_frame_in_use(pfn, false);
+	}
+
+	return true;
+}
+
+/**
+ * add_memory(@nr_frames)
+ *
+ * DESCRIPTION
+ *   Hot-add @nr_frames page frames at the end of the frame space. The frame
+ *   metadata are extended in place, and the new frames become available for
+ *   the allocation immediately. The system brings up its initial memory with
+ *   this function as well.
+ *
+ * RETURN
+ *   @true on success
+ *   @false if unable to extend the frame metadata
+ */
+bool add_memory(unsigned int nr_frames)
+{
+	if (!__resize_frame_metadata(nr_pageframes + nr_frames)) return false;
+
+	nr_pageframes += nr_frames;
+	return true;
+}
+
+/**
+ * __migrate_frame(@from, @to)
+ *
+ * DESCRIPTION
+ *   Move the contents of the frame @from to the free frame @to, and make all
+ *   PTEs mapping @from to map @to by following the rmap of @from.
+ */
+static void __migrate_frame(unsigned int from, unsigned int to)
+{
+	for (struct rmap_item *item = mem_map[from].rmap; item; item = item->next) {
+		struct pagetable *pt = &item->process->pagetable;
+		struct pte_directory *pd = pt->outer_ptes[item->vpn / NR_PTES_PER_PAGE];
+
+		pd->ptes[item->vpn % NR_PTES_PER_PAGE].pfn = to;
+		__update_contig_hint(pd, item->vpn % NR_PTES_PER_PAGE);
+		__update_range(pt, item->vpn);
+	}
+
+	mem_map[to].rmap = mem_map[from].rmap;
+	mem_map[from].rmap = NULL;
+	mem_map[to].owner = mem_map[from].owner;
+	mem_map[from].owner = NULL;
+	set_page_mapcount(to, page_mapcount(from));
+	set_page_mapcount(from, 0);
+}
+
+/**
+ * __evict_frame(@pfn)
+ *
+ * DESCRIPTION
+ *   Unmap the frame @pfn from all PTEs mapping it by following its rmap.
+ *   The contents of the frame are lost as there is no backing store.
+ */
+static void __evict_frame(unsigned int pfn)
+{
+	struct rmap_item *item;
+
+	while ((item = mem_map[pfn].rmap)) {
+		struct pagetable *pt = &item->process->pagetable;
+		struct pte_directory *pd = pt->outer_ptes[item->vpn / NR_PTES_PER_PAGE];
+
+		mem_map[pfn].rmap = item->next;
+		if (__pte_committed(&pd->ptes[item->vpn % NR_PTES_PER_PAGE])) {
+			__uncharge_commit(item->process, 1);
+		}
+		__unmap_pte(pt, item->vpn);
+		arena_free(item);
+	}
+	set_page_mapcount(pfn, 0);
+}
+
+/**
+ * remove_memory(@start, @nr_frames, @nr_migrated, @nr_evicted)
+ *
+ * DESCRIPTION
+ *   Hot-remove the page frames in [@start, @start + @nr_frames). The frames
+ *   in use are migrated to free frames outside the range. When no free frame
+ *   is available, they are evicted from all processes mapping them. The
+ *   removed frames at the end of the frame space shrink the frame space,
+ *   and the others remain offline.
+ *
+ * RETURN
+ *   The number of frames removed. The numbers of migrated and evicted frames
+ *   are returned through @nr_migrated and @nr_evicted.
+ */
+unsigned int remove_memory(unsigned int start, unsigned int nr_frames,
+		unsigned int *nr_migrated, unsigned int *nr_evicted)
+{
+	unsigned int end = start + nr_frames;
+	unsigned int nr_removed = 0;
+	unsigned int pfn;
+
+	*nr_migrated = *nr_evicted = 0;
+
+	if (start >= nr_pageframes) return 0;
+	if (end > nr_pageframes || end < start) end = nr_pageframes;
+
+	/* Take the frames offline first so that they are not migration targets */
+	for (pfn = start; pfn < end; pfn++) {
+		if (mem_map[pfn].flags & PG_OFFLINE) continue;
+
+		mem_map[pfn].flags |= PG_OFFLINE;
+		__set_frame_in_use(pfn, true);
+		nr_removed++;
+	}
+
+	for (pfn = start; pfn < end; pfn++) {
+		int to;
+
+		if (!page_mapcount(pfn)) continue;
+
+		to = __find_free_frame(pfn % NR_CACHE_COLORS);
+		if (to < 0) to = __find_free_frame_in(0, NR_CACHE_COLORS);
+
+		if (to >= 0) {
+			__set_frame_in_use(to, true);
+			__migrate_frame(pfn, to);
+			(*nr_migrated)++;
+		} else {
+			__evict_frame(pfn);
+			__uncharge_frame(pfn);
+			(*nr_evicted)++;
+		}
+	}
+
+	for (end = nr_pageframes; end > 0 && (mem_map[end - 1].flags & PG_OFFLINE); end--);
+	if (end < nr_pageframes) {
+		nr_pageframes = end;
+		__resize_frame_metadata(nr_pageframes);
+	}
+
+	return nr_removed;
+}
+
+
+/**
+ * inflate_balloon(@guest, @nr_pages)
+ *
+ * DESCRIPTION
+ *   Inflate the balloon of @guest by @nr_pages to surrender the frames to the
+ *   host. When the guest uses more frames than the balloon leaves, the guest
+ *   reclaims the pages by evicting its frames from the highest pfn.
+ *
+ * RETURN
+ *   The number of pages reclaimed to inflate the balloon
+ */
+unsigned int inflate_balloon(struct guest *guest, unsigned int nr_pages)
+{
+	unsigned int nr_reclaimed = 0;
+	unsigned int pfn = nr_pageframes;
+
+	guest->balloon += nr_pages;
+	nr_balloon_frames += nr_pages;
+
+	while ((int)guest->nr_used > (int)guest->nr_frames - guest->balloon && pfn > 0) {
+		pfn--;
+		if (mem_map[pfn].owner != guest || (mem_map[pfn].flags & PG_OFFLINE)) continue;
+
+		__evict_frame(pfn);
+		__free_frame(pfn);
+		nr_reclaimed++;
+	}
+
+	guest->nr_reclaimed += nr_reclaimed;
+	return nr_reclaimed;
+}
+
+/**
+ * deflate_balloon(@guest, @nr_pages)
+ *
+ * DESCRIPTION
+ *   Deflate the balloon of @guest by @nr_pages to get the frames surrendered
+ *   to the host by the balloons. The guest can get no more than the host has.
+ *
+ * RETURN
+ *   The number of frames the guest gained
+ */
+unsigned int deflate_balloon(struct guest *guest, unsigned int nr_pages)
+{
+	if (nr_pages > nr_balloon_frames) nr_pages = nr_balloon_frames;
+
+	guest->balloon -= nr_pages;
+	nr_balloon_frames -= nr_pages;
+
+	guest->nr_gained += nr_pages;
+	return nr_pages;
+}
+
+/**
+ * persist_memory_state()
+ *
+ * DESCRIPTION
+ *   Make the frame metadata of the system persist in the arena. The objects
+ *   they point to are allocated from the arena already.
+ */
+void persist_memory_state(void)
+{
+	arena_persist(frames_in_use, sizeof(frames_in_use));
+	arena_persist(&nr_color_words, sizeof(nr_color_words));
+}
@@ -0,0 +1,384 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "types.h"
+#include "perf.h"
+
+bool perf_enabled = false;
+
+static const struct {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+} perf_events[NR_PERF_COUNTERS] = {
+	[PERF_CYCLES] = { "cycles",
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { "instrs",
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CACHE_MISSES] = { "LLC miss",
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_DTLB_MISSES] = { "dTLB miss",
+		PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	[PERF_TASK_CLOCK] = { "time (ns)",
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+static const char *phase_names[NR_PERF_PHASES] = {
+	[PERF_PARSE] = "parse",
+	[PERF_TRANSLATE] = "translate",
+	[PERF_FAULT] = "fault",
+	[PERF_FORK] = "fork",
+};
+
+/* Phases too short to read the counters with system calls every time */
+static const bool short_phases[NR_PERF_PHASES] = {
+	[PERF_TRANSLATE] = true,
+	[PERF_FAULT] = true,
+};
+
+/**
+ * Counter group of the calling thread. The group is read at once, and the
+ * values come in the order the counters joined the group.
+ */
+static __thread int group_fd = -1;
+static __thread int counter_fds[NR_PERF_COUNTERS];
+static __thread unsigned int nr_members = 0;
+static __thread enum perf_counter members[NR_PERF_COUNTERS];
+
+/**
+ * Pages the kernel exports the hardware counters through. If @user_readable,
+ * all of them can be read with rdpmc.
+ */
+static __thread struct perf_event_mmap_page *user_pages[NR_PERF_COUNTERS];
+static __thread bool user_readable = false;
+
+/* Counts of reading the counters back to back, taken off each interval */
+static __thread unsigned long long overheads[NR_PERF_COUNTERS];
+static __thread unsigned long random_state = 0;
+
+/**
+ * The counters available on any thread, and the counts of each phase. The
+ * phases run on different threads, so the counts are updated atomically.
+ */
+static bool available[NR_PERF_COUNTERS];
+static unsigned long long counts[NR_PERF_PHASES][NR_PERF_COUNTERS];
+static unsigned long nr_intervals[NR_PERF_PHASES];
+static unsigned long nr_sampled[NR_PERF_PHASES];
+
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long __rdpmc(unsigned int counter)
+{
+	unsigned int low, high;
+
+	__asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+	return low | ((unsigned long long)high << 32);
+}
+
+/**
+ * Read the counter through @page under its sequence lock, as described in
+ * linux/perf_event.h. Fail if the counter is not on the PMU at the moment.
+ */
+static bool __read_user_counter(struct perf_event_mmap_page *page,
+		unsigned long long *value)
+{
+	unsigned int seq, index;
+	long long count, pmc;
+
+	do {
+		seq = page->lock;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+		index = page->index;
+		if (!page->cap_user_rdpmc || !index) return false;
+
+		count = page->offset;
+		pmc = __rdpmc(index - 1);
+		pmc <<= 64 - page->pmc_width;
+		pmc >>= 64 - page->pmc_width;
+		count += pmc;
+
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	} while (page->lock != seq);
+
+	*value = count;
+	return true;
+}
+#else
+static bool __read_user_counter(struct perf_event_mmap_page *page,
+		unsigned long long *value)
+{
+	return false;
+}
+#endif
+
+
+void close_perf_counters(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	for (unsigned int i = 0; i < nr_members; i++) {
+		close(counter_fds[i]);
+	}
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (user_pages[i]) munmap(user_pages[i], page_size);
+		user_pages[i] = NULL;
+	}
+	group_fd = -1;
+	nr_members = 0;
+	user_readable = false;
+}
+
+static bool __read_group(struct perf_sample *sample)
+{
+	struct {
+		unsigned long long nr;
+		unsigned long long values[NR_PERF_COUNTERS];
+	} group;
+
+	if (read(group_fd, &group, sizeof(group)) < (ssize_t)sizeof(group.nr)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < group.nr && i < nr_members; i++) {
+		sample->values[members[i]] = group.values[i];
+	}
+	return true;
+}
+
+static bool __read_counters(struct perf_sample *sample)
+{
+	struct timespec now;
+
+	if (!user_readable) return __read_group(sample);
+
+	for (unsigned int i = 0; i < nr_members; i++) {
+		enum perf_counter counter = members[i];
+
+		if (counter == PERF_TASK_CLOCK) continue;
+		/* Fall back to the system call if the counter is off the PMU */
+		if (!__read_user_counter(user_pages[counter], &sample->values[counter])) {
+			if (!__read_group(sample)) return false;
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sample->values[PERF_TASK_CLOCK] = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	return true;
+}
+
+static void __map_user_pages(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	bool readable = true;
+
+	for (unsigned int i = 0; i < nr_members; i++) {
+		enum perf_counter counter = members[i];
+		void *page;
+
+		if (perf_events[counter].type == PERF_TYPE_SOFTWARE) continue;
+
+		page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, counter_fds[i], 0);
+		if (page == MAP_FAILED) {
+			readable = false;
+			continue;
+		}
+		user_pages[counter] = page;
+		readable &= user_pages[counter]->cap_user_rdpmc;
+	}
+
+	/* Time is taken from the clock then, which needs a hardware counter */
+	user_readable = readable && nr_members > (available[PERF_TASK_CLOCK] ? 1 : 0);
+#if !defined(__x86_64__) && !defined(__i386__)
+	user_readable = false;
+#endif
+}
+
+static int __compare_counts(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Take the median counts of reading the counters back to back as the cost of
+ * the reading included in each interval
+ */
+static void __calibrate(void)
+{
+	unsigned long long deltas[NR_PERF_COUNTERS][PERF_CALIBRATIONS];
+	unsigned int nr_deltas = 0;
+
+	memset(overheads, 0x00, sizeof(overheads));
+
+	for (int n = 0; n < PERF_CALIBRATIONS; n++) {
+		struct perf_sample begin, end;
+
+		if (!__read_counters(&begin) || !__read_counters(&end)) continue;
+
+		for (unsigned int i = 0; i < nr_members; i++) {
+			enum perf_counter counter = members[i];
+
+			deltas[counter][nr_deltas] = end.values[counter] - begin.values[counter];
+		}
+		nr_deltas++;
+	}
+	if (!nr_deltas) return;
+
+	for (unsigned int i = 0; i < nr_members; i++) {
+		enum perf_counter counter = members[i];
+
+		qsort(deltas[counter], nr_deltas, sizeof(deltas[counter][0]), __compare_counts);
+		overheads[counter] = deltas[counter][nr_deltas / 2];
+	}
+}
+
+bool open_perf_counters(void)
+{
+	if (!perf_enabled || group_fd >= 0) return group_fd >= 0;
+
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		int fd;
+
+		memset(&attr, 0x00, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = (group_fd < 0);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+		if (fd < 0) continue;
+
+		if (group_fd < 0) group_fd = fd;
+		counter_fds[nr_members] = fd;
+		members[nr_members++] = i;
+		available[i] = true;
+	}
+	if (group_fd < 0) return false;
+
+	ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	__map_user_pages();
+	__calibrate();
+	random_state = 0x9e3779b97f4a7c15UL ^ (unsigned long)&random_state;
+	return true;
+}
+
+static unsigned long __next_random(void)
+{
+	/* xorshift64 */
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+void perf_begin(enum perf_phase phase, struct perf_sample *sample)
+{
+	sample->taken = false;
+
+	if (group_fd < 0) return;
+	if (!user_readable && short_phases[phase] &&
+			__next_random() % PERF_SAMPLE_PERIOD) {
+		return;
+	}
+
+	sample->taken = __read_counters(sample);
+}
+
+void perf_end(enum perf_phase phase, struct perf_sample *sample)
+{
+	struct perf_sample now;
+
+	if (group_fd < 0) return;
+
+	__atomic_fetch_add(&nr_intervals[phase], 1, __ATOMIC_RELAXED);
+	if (!sample->taken || !__read_counters(&now)) return;
+
+	for (unsigned int i = 0; i < nr_members; i++) {
+		enum perf_counter counter = members[i];
+		unsigned long long delta = now.values[counter] - sample->values[counter];
+
+		delta = delta > overheads[counter] ? delta - overheads[counter] : 0;
+		__atomic_fetch_add(&counts[phase][counter], delta, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&nr_sampled[phase], 1, __ATOMIC_RELAXED);
+}
+
+void show_perf_stats(void)
+{
+	bool any = false;
+
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		any |= available[i];
+	}
+
+	fprintf(stderr, "*** Host counters ***\n");
+	if (!any) {
+		fprintf(stderr, "not available on this host\n\n");
+		return;
+	}
+
+	fprintf(stderr, "%-9s %10s %10s", "phase", "intervals", "sampled");
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		fprintf(stderr, " %14s", perf_events[i].name);
+	}
+	fprintf(stderr, " %6s\n", "IPC");
+
+	for (int phase = 0; phase < NR_PERF_PHASES; phase++) {
+		unsigned long long count[NR_PERF_COUNTERS];
+
+		/* Scale the sampled intervals to all intervals */
+		for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+			count[i] = nr_sampled[phase] ?
+				(double)counts[phase][i] * nr_intervals[phase] / nr_sampled[phase] : 0;
+		}
+
+		fprintf(stderr, "%-9s %10lu %10lu", phase_names[phase],
+				nr_intervals[phase], nr_sampled[phase]);
+		for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+			if (available[i]) {
+				fprintf(stderr, " %14llu", count[i]);
+			} else {
+				fprintf(stderr, " %14s", "n/a");
+			}
+		}
+		if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] &&
+				count[PERF_CYCLES]) {
+			fprintf(stderr, " %6.2f\n",
+					(double)count[PERF_INSTRUCTIONS] / count[PERF_CYCLES]);
+		} else {
+			fprintf(stderr, " %6s\n", "n/a");
+		}
+	}
+	fprintf(stderr, "\n");
+}
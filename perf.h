@@ -0,0 +1,106 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include "types.h"
+
+/**
+ * Host performance counters around the phases of the simulator. Each thread
+ * running a phase opens its own group of counters, which count the user-mode
+ * events of the thread only. The counters the host does not support (e.g.,
+ * the hardware events in a virtual machine) are left out, and the phases are
+ * measured with the rest of them.
+ *
+ * The phases are as short as a translation, so the counters are read in user
+ * space with rdpmc where the host allows it for all hardware counters, and
+ * the time is taken from the vDSO clock then. Otherwise, reading the counters
+ * takes a system call, which would dwarf the short phases (translate and
+ * fault); only one in PERF_SAMPLE_PERIOD of their intervals picked at random
+ * is measured then, and the counts are scaled to all intervals. Either way,
+ * the median cost of reading the counters back to back, calibrated when they
+ * are opened, is taken off each interval. The system calls still disturb the
+ * host caches for the sampled intervals.
+ */
+enum perf_phase {
+	PERF_PARSE,		/* Decoding the trace in the decoder threads */
+	PERF_TRANSLATE,		/* Address translation by the MMU */
+	PERF_FAULT,		/* Page fault handling */
+	PERF_FORK,		/* Switching to (and forking) processes */
+	NR_PERF_PHASES,
+};
+
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_TASK_CLOCK,	/* In ns. Available even without the PMU */
+	NR_PERF_COUNTERS,
+};
+
+/**
+ * Snapshot of the counters at the beginning of a phase
+ */
+struct perf_sample {
+	bool taken;		/* The interval is sampled and @values are read */
+	unsigned long long values[NR_PERF_COUNTERS];
+};
+
+#define PERF_SAMPLE_PERIOD	64
+#define PERF_CALIBRATIONS	64
+
+extern bool perf_enabled;
+
+/***********************************************************************
+ * open_perf_counters()
+ *
+ * DESCRIPTION
+ *  Open the counters for the calling thread if @perf_enabled.
+ *
+ * RETURN VALUE
+ *  Return @true if any counter is available
+ */
+bool open_perf_counters(void);
+
+/***********************************************************************
+ * close_perf_counters()
+ *
+ * DESCRIPTION
+ *  Close the counters of the calling thread.
+ */
+void close_perf_counters(void);
+
+/***********************************************************************
+ * perf_begin(), perf_end()
+ *
+ * DESCRIPTION
+ *  Take the snapshot of the counters of the calling thread into @sample at
+ *  the beginning of @phase, and charge the counts since @sample to @phase at
+ *  the end of it. They do nothing if the thread has no counter open, and the
+ *  phase is not charged if the counters could not be read at either end.
+ */
+void perf_begin(enum perf_phase phase, struct perf_sample *sample);
+void perf_end(enum perf_phase phase, struct perf_sample *sample);
+
+/***********************************************************************
+ * show_perf_stats()
+ *
+ * DESCRIPTION
+ *  Report the counts of each phase.
+ */
+void show_perf_stats(void);
+
+#endif
@@ -0,0 +1,230 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "prefetch.h"
+
+/**
+ * Prediction tables
+ */
+static struct prediction_row *__find_row(struct prefetcher *pf, int tag)
+{
+	struct prediction_row *row = &pf->rows[(unsigned int)tag % NR_PREDICTION_ROWS];
+
+	if (!row->valid || row->tag != tag) return NULL;
+	return row;
+}
+
+static void __record_row(struct prefetcher *pf, int tag, int next)
+{
+	struct prediction_row *row = &pf->rows[(unsigned int)tag % NR_PREDICTION_ROWS];
+	unsigned int i;
+
+	if (!row->valid || row->tag != tag) {
+		row->valid = true;
+		row->tag = tag;
+		row->nr_next = 0;
+	}
+
+	for (i = 0; i < row->nr_next && row->next[i] != next; i++);
+	if (i == row->nr_next && row->nr_next < MAX_PREDICTIONS) row->nr_next++;
+	if (i == MAX_PREDICTIONS) i--;
+
+	/* Move @next to the front */
+	for (; i > 0; i--) {
+		row->next[i] = row->next[i - 1];
+	}
+	row->next[0] = next;
+}
+
+
+/**
+ * Sequential predictor; the next page will be missed
+ */
+static unsigned int __predict_sequential(struct prefetcher *pf __attribute__((unused)),
+		unsigned int vpn, unsigned int vpns[])
+{
+	vpns[0] = vpn + 1;
+	return 1;
+}
+
+/**
+ * Distance predictor; the distances between the consecutive misses follow
+ * the pattern observed before. The table is indexed by the distance to the
+ * previous miss, and remembers the distances that followed it.
+ */
+static unsigned int __predict_distance(struct prefetcher *pf, unsigned int vpn, unsigned int vpns[])
+{
+	struct prediction_row *row;
+	unsigned int nr_vpns = 0;
+	int distance;
+
+	if (!pf->has_history) {
+		pf->has_history = true;
+		pf->last_vpn = vpn;
+		pf->last_distance = 0;
+		return 0;
+	}
+
+	distance = (int)vpn - (int)pf->last_vpn;
+	__record_row(pf, pf->last_distance, distance);
+
+	row = __find_row(pf, distance);
+	if (row) {
+		for (unsigned int i = 0; i < row->nr_next; i++) {
+			vpns[nr_vpns++] = vpn + row->next[i];
+		}
+	}
+
+	pf->last_vpn = vpn;
+	pf->last_distance = distance;
+	return nr_vpns;
+}
+
+/**
+ * Markov predictor; the table is indexed by the missed VPN, and remembers
+ * the VPNs that were missed right after it.
+ */
+static unsigned int __predict_markov(struct prefetcher *pf, unsigned int vpn, unsigned int vpns[])
+{
+	struct prediction_row *row;
+	unsigned int nr_vpns = 0;
+
+	if (pf->has_history) {
+		__record_row(pf, pf->last_vpn, vpn);
+	}
+
+	row = __find_row(pf, vpn);
+	if (row) {
+		for (unsigned int i = 0; i < row->nr_next; i++) {
+			vpns[nr_vpns++] = row->next[i];
+		}
+	}
+
+	pf->has_history = true;
+	pf->last_vpn = vpn;
+	return nr_vpns;
+}
+
+static struct prefetcher prefetchers[] = {
+	{ .name = "sequential", .predict = __predict_sequential, },
+	{ .name = "distance", .predict = __predict_distance, },
+	{ .name = "markov", .predict = __predict_markov, },
+};
+#define NR_PREFETCHERS	(sizeof(prefetchers) / sizeof(*prefetchers))
+
+
+/**
+ * Prefetch buffers
+ */
+static struct prefetch_entry *__find_entry(struct prefetcher *pf, unsigned int vpn)
+{
+	for (int i = 0; i < NR_PREFETCH_ENTRIES; i++) {
+		struct prefetch_entry *pe = &pf->buffer[i];
+
+		if (pe->valid && pe->vpn == vpn) return pe;
+	}
+	return NULL;
+}
+
+static void __insert_entry(struct prefetcher *pf, unsigned int vpn, unsigned int pfn)
+{
+	struct prefetch_entry *pe = &pf->buffer[pf->next_victim];
+
+	if (pe->valid) pf->nr_unused++;
+
+	pe->valid = true;
+	pe->vpn = vpn;
+	pe->pfn = pfn;
+
+	pf->next_victim = (pf->next_victim + 1) % NR_PREFETCH_ENTRIES;
+	pf->nr_issued++;
+}
+
+void prefetch_on_miss(unsigned int vpn, bool (*walk)(unsigned int vpn, unsigned int *pfn))
+{
+	for (int i = 0; i < NR_PREFETCHERS; i++) {
+		struct prefetcher *pf = &prefetchers[i];
+		struct prefetch_entry *pe = __find_entry(pf, vpn);
+		unsigned int vpns[MAX_PREDICTIONS];
+		unsigned int nr_vpns;
+
+		if (pe) {
+			pe->valid = false;
+			pf->nr_useful++;
+		}
+
+		nr_vpns = pf->predict(pf, vpn, vpns);
+
+		for (unsigned int j = 0; j < nr_vpns; j++) {
+			unsigned int pfn;
+
+			if (vpns[j] == vpn) continue;
+			if (vpns[j] >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) continue;
+			if (__find_entry(pf, vpns[j])) continue;
+
+			if (walk(vpns[j], &pfn)) {
+				__insert_entry(pf, vpns[j], pfn);
+			} else {
+				pf->nr_failed++;
+			}
+		}
+	}
+}
+
+void invalidate_prefetch(unsigned int vpn)
+{
+	for (int i = 0; i < NR_PREFETCHERS; i++) {
+		struct prefetch_entry *pe = __find_entry(&prefetchers[i], vpn);
+
+		if (pe) {
+			pe->valid = false;
+			prefetchers[i].nr_unused++;
+		}
+	}
+}
+
+void flush_prefetch(void)
+{
+	for (int i = 0; i < NR_PREFETCHERS; i++) {
+		struct prefetcher *pf = &prefetchers[i];
+
+		for (int j = 0; j < NR_PREFETCH_ENTRIES; j++) {
+			if (pf->buffer[j].valid) pf->nr_unused++;
+		}
+		memset(pf->buffer, 0x00, sizeof(pf->buffer));
+		pf->has_history = false;
+	}
+}
+
+void show_prefetch_stats(unsigned long nr_misses)
+{
+	for (int i = 0; i < NR_PREFETCHERS; i++) {
+		struct prefetcher *pf = &prefetchers[i];
+
+		fprintf(stderr, "%-10s: %lu issued, %lu useful, "
+				"accuracy %.2f%%, coverage %.2f%%, wasted walks %lu\n",
+				pf->name, pf->nr_issued, pf->nr_useful,
+				pf->nr_issued ? pf->nr_useful * 100.0 / pf->nr_issued : 0.0,
+				nr_misses ? pf->nr_useful * 100.0 / nr_misses : 0.0,
+				pf->nr_unused + pf->nr_failed);
+	}
+}
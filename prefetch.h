@@ -0,0 +1,105 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "types.h"
+
+/* The number of translations each prefetcher can keep in its buffer */
+#define NR_PREFETCH_ENTRIES	4
+
+/* The maximum number of VPNs a predictor can predict on a miss */
+#define MAX_PREDICTIONS		2
+
+/* The number of rows in the distance and Markov prediction tables */
+#define NR_PREDICTION_ROWS	64
+
+struct prefetch_entry {
+	bool valid;
+	unsigned int vpn;
+	unsigned int pfn;
+};
+
+/**
+ * Prediction table row. Remembers up to MAX_PREDICTIONS values that followed
+ * @tag last time, most recent one first.
+ */
+struct prediction_row {
+	bool valid;
+	int tag;
+	int next[MAX_PREDICTIONS];
+	unsigned int nr_next;
+};
+
+struct prefetcher {
+	const char *name;
+
+	/* Predict the VPNs to be missed after @vpn into @vpns */
+	unsigned int (*predict)(struct prefetcher *pf, unsigned int vpn, unsigned int vpns[]);
+
+	/* Prefetch buffer, which is managed in FIFO */
+	struct prefetch_entry buffer[NR_PREFETCH_ENTRIES];
+	unsigned int next_victim;
+
+	/* History of the misses and the prediction table for the predictor */
+	bool has_history;
+	unsigned int last_vpn;
+	int last_distance;
+	struct prediction_row rows[NR_PREDICTION_ROWS];
+
+	unsigned long nr_issued;	/* Translations prefetched into the buffer */
+	unsigned long nr_useful;	/* Misses that hit in the buffer */
+	unsigned long nr_unused;	/* Prefetched but evicted before used */
+	unsigned long nr_failed;	/* Walks for the unmapped predictions */
+};
+
+/***********************************************************************
+ * prefetch_on_miss()
+ *
+ * DESCRIPTION
+ *  Notify all prefetchers the TLB miss on @vpn. Each prefetcher looks up its
+ *  prefetch buffer for @vpn, and then walks the page table with @walk for the
+ *  VPNs it predicts to fill its buffer. The prefetchers are evaluated in
+ *  parallel, and they do not affect the TLB.
+ */
+void prefetch_on_miss(unsigned int vpn, bool (*walk)(unsigned int vpn, unsigned int *pfn));
+
+/***********************************************************************
+ * invalidate_prefetch()
+ *
+ * DESCRIPTION
+ *  Invalidate the prefetched translations for @vpn.
+ */
+void invalidate_prefetch(unsigned int vpn);
+
+/***********************************************************************
+ * flush_prefetch()
+ *
+ * DESCRIPTION
+ *  Invalidate all prefetched translations. The miss histories are also
+ *  reset as they are for the previous address space.
+ */
+void flush_prefetch(void);
+
+/***********************************************************************
+ * show_prefetch_stats()
+ *
+ * DESCRIPTION
+ *  Print out the accuracy, coverage, and wasted walks of each prefetcher
+ *  over @nr_misses TLB misses.
+ */
+void show_prefetch_stats(unsigned long nr_misses);
+
+#endif
@@ -0,0 +1,473 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "trace.h"
+#include "sample.h"
+
+enum sampling_mode sampling_mode = SAMPLING_NONE;
+unsigned int sample_period = DEFAULT_SAMPLE_PERIOD;
+unsigned long sample_window = DEFAULT_SAMPLE_WINDOW;
+unsigned long sample_warmup = DEFAULT_SAMPLE_WARMUP;
+
+static const char * const sampling_names[] = {
+	[SAMPLING_NONE] = "none",
+	[SAMPLING_SYSTEMATIC] = "systematic",
+	[SAMPLING_SIMPOINT] = "simpoint",
+	[SAMPLING_VPN] = "vpn",
+};
+
+/**
+ * The accesses simulated in detail in a window (or a group of VPNs for the
+ * VPN sampling). Each sample stands for @weight windows (or groups).
+ */
+struct sample {
+	unsigned long window;
+	double weight;
+
+	unsigned long nr_accesses;
+	unsigned long nr_faults;
+	unsigned long nr_tlb_misses;
+	unsigned long cycles;
+};
+
+static struct sample *samples = NULL;
+static unsigned long nr_samples = 0;
+static unsigned long max_samples = 0;
+
+/* Sample the access being simulated in detail belongs to */
+static unsigned long current_sample = 0;
+
+/* Number of accesses seen including the fast-forwarded ones */
+static unsigned long nr_accesses = 0;
+
+/**
+ * Windows chosen by the SimPoint-style clustering. @simpoint_weights[i] is
+ * the size of the cluster that window i represents, or 0 if the window is
+ * not sampled.
+ */
+static unsigned long nr_windows = 0;
+static double *simpoint_weights = NULL;
+static unsigned int nr_clusters = 0;
+
+
+bool parse_sampling(char *spec)
+{
+	char *period = strchr(spec, ':');
+
+	if (period) {
+		char *end;
+
+		*period++ = '\0';
+		sample_period = strtoul(period, &end, 0);
+		if (*end != '\0' || sample_period == 0) return false;
+	}
+
+	for (int i = SAMPLING_SYSTEMATIC; i <= SAMPLING_VPN; i++) {
+		if (strcmp(spec, sampling_names[i]) == 0) {
+			sampling_mode = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline unsigned int __hash_vpn(unsigned int vpn)
+{
+	return (vpn * 2654435761U) >> 16;
+}
+
+
+static double __distance(const double *a, const double *b)
+{
+	double sum = 0.0;
+
+	for (int i = 0; i < NR_SIGNATURE_BUCKETS; i++) {
+		sum += (a[i] - b[i]) * (a[i] - b[i]);
+	}
+	return sum;
+}
+
+/**
+ * Cluster the window signatures with k-means. The initial centroids are the
+ * farthest windows from the centroids chosen so far starting from the first
+ * window, which keeps the clustering deterministic.
+ */
+static void __cluster_windows(double (*signatures)[NR_SIGNATURE_BUCKETS],
+		unsigned int k, unsigned int *clusters)
+{
+	double (*centroids)[NR_SIGNATURE_BUCKETS] = calloc(k, sizeof(*centroids));
+	double *distances = malloc(sizeof(*distances) * nr_windows);
+	unsigned long *sizes = calloc(k, sizeof(*sizes));
+	unsigned long *closest = calloc(k, sizeof(*closest));
+
+	memcpy(centroids[0], signatures[0], sizeof(*centroids));
+	for (unsigned long w = 0; w < nr_windows; w++) {
+		distances[w] = __distance(signatures[w], centroids[0]);
+	}
+	for (unsigned int c = 1; c < k; c++) {
+		unsigned long farthest = 0;
+
+		for (unsigned long w = 1; w < nr_windows; w++) {
+			if (distances[w] > distances[farthest]) farthest = w;
+		}
+		memcpy(centroids[c], signatures[farthest], sizeof(*centroids));
+		for (unsigned long w = 0; w < nr_windows; w++) {
+			double d = __distance(signatures[w], centroids[c]);
+
+			if (d < distances[w]) distances[w] = d;
+		}
+	}
+
+	for (unsigned long w = 0; w < nr_windows; w++) {
+		clusters[w] = k;
+	}
+
+	for (int iter = 0; iter < MAX_KMEANS_ITERATIONS; iter++) {
+		bool changed = false;
+
+		for (unsigned long w = 0; w < nr_windows; w++) {
+			unsigned int nearest = 0;
+
+			for (unsigned int c = 1; c < k; c++) {
+				if (__distance(signatures[w], centroids[c]) <
+						__distance(signatures[w], centroids[nearest])) {
+					nearest = c;
+				}
+			}
+			if (clusters[w] != nearest) changed = true;
+			clusters[w] = nearest;
+		}
+		if (!changed) break;
+
+		memset(centroids, 0x00, sizeof(*centroids) * k);
+		memset(sizes, 0x00, sizeof(*sizes) * k);
+		for (unsigned long w = 0; w < nr_windows; w++) {
+			for (int i = 0; i < NR_SIGNATURE_BUCKETS; i++) {
+				centroids[clusters[w]][i] += signatures[w][i];
+			}
+			sizes[clusters[w]]++;
+		}
+		for (unsigned int c = 0; c < k; c++) {
+			for (int i = 0; i < NR_SIGNATURE_BUCKETS && sizes[c]; i++) {
+				centroids[c][i] /= sizes[c];
+			}
+		}
+	}
+
+	/* Sample the window closest to the centroid of each cluster */
+	memset(sizes, 0x00, sizeof(*sizes) * k);
+	for (unsigned int c = 0; c < k; c++) {
+		distances[c] = INFINITY;
+		closest[c] = 0;
+	}
+	for (unsigned long w = 0; w < nr_windows; w++) {
+		unsigned int c = clusters[w];
+		double d = __distance(signatures[w], centroids[c]);
+
+		sizes[c]++;
+		if (d < distances[c]) {
+			distances[c] = d;
+			closest[c] = w;
+		}
+	}
+	for (unsigned int c = 0; c < k; c++) {
+		if (!sizes[c]) continue;
+		simpoint_weights[closest[c]] = sizes[c];
+		nr_clusters++;
+	}
+
+	free(centroids);
+	free(distances);
+	free(sizes);
+	free(closest);
+}
+
+bool profile_simpoints(FILE *inputs[], unsigned int nr_inputs, unsigned int page_shift)
+{
+	double (*signatures)[NR_SIGNATURE_BUCKETS] = NULL;
+	unsigned long max_windows = 0;
+	unsigned long n = 0;
+	unsigned int *clusters;
+	struct trace *trace;
+	struct trace_op *op;
+
+	if (nr_inputs > 1) {
+		trace = open_merged_trace(inputs, nr_inputs);
+	} else {
+		trace = open_trace(inputs[0]);
+	}
+	if (!trace) return false;
+
+	while ((op = next_trace_op(trace))) {
+		unsigned long vpn = op->args[0];
+		unsigned long w = n / sample_window;
+
+		if (op->opcode == TRACE_EXIT) break;
+		if (op->opcode == TRACE_LOAD || op->opcode == TRACE_STORE) {
+			vpn = op->args[0] >> page_shift;
+		} else if (op->opcode != TRACE_READ && op->opcode != TRACE_WRITE &&
+				op->opcode != TRACE_ACCESS) {
+			continue;
+		}
+		if (vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) continue;
+
+		if (w == max_windows) {
+			void *p;
+
+			max_windows = max_windows ? max_windows * 2 : 1024;
+			p = realloc(signatures, sizeof(*signatures) * max_windows);
+			if (!p) {
+				close_trace(trace);
+				free(signatures);
+				return false;
+			}
+			signatures = p;
+			memset(signatures[w], 0x00, sizeof(*signatures) * (max_windows - w));
+		}
+		signatures[w][__hash_vpn(vpn) % NR_SIGNATURE_BUCKETS] += 1.0;
+		n++;
+	}
+	close_trace(trace);
+
+	for (unsigned int i = 0; i < nr_inputs; i++) {
+		if (lseek(fileno(inputs[i]), 0, SEEK_SET) < 0) {
+			fprintf(stderr, "SimPoint sampling requires seekable workload files\n");
+			free(signatures);
+			return false;
+		}
+	}
+
+	nr_windows = (n + sample_window - 1) / sample_window;
+	if (!nr_windows) {
+		free(signatures);
+		return true;
+	}
+
+	/* Normalize the signatures by the number of accesses in the windows */
+	for (unsigned long w = 0; w < nr_windows; w++) {
+		unsigned long nr = w == nr_windows - 1 ? n - w * sample_window : sample_window;
+
+		for (int i = 0; i < NR_SIGNATURE_BUCKETS; i++) {
+			signatures[w][i] /= nr;
+		}
+	}
+
+	simpoint_weights = calloc(nr_windows, sizeof(*simpoint_weights));
+	clusters = calloc(nr_windows, sizeof(*clusters));
+	if (!simpoint_weights || !clusters) {
+		free(signatures);
+		free(clusters);
+		return false;
+	}
+
+	__cluster_windows(signatures, sample_period < nr_windows ? sample_period : nr_windows,
+			clusters);
+
+	free(signatures);
+	free(clusters);
+
+	return true;
+}
+
+
+static void __start_sample(unsigned long window, double weight)
+{
+	struct sample *sample;
+
+	if (nr_samples && samples[nr_samples - 1].window == window) {
+		current_sample = nr_samples - 1;
+		return;
+	}
+
+	if (nr_samples == max_samples) {
+		void *p;
+
+		max_samples = max_samples ? max_samples * 2 : 64;
+		p = realloc(samples, sizeof(*samples) * max_samples);
+		if (!p) {
+			fprintf(stderr, "Unable to record the samples\n");
+			exit(EXIT_FAILURE);
+		}
+		samples = p;
+	}
+
+	sample = &samples[nr_samples++];
+	memset(sample, 0x00, sizeof(*sample));
+	sample->window = window;
+	sample->weight = weight;
+	current_sample = nr_samples - 1;
+}
+
+static void __start_vpn_sample(unsigned int group)
+{
+	if (!nr_samples) {
+		for (unsigned int i = 0; i < NR_VPN_GROUPS; i++) {
+			__start_sample(i, sample_period);
+		}
+	}
+	current_sample = group;
+}
+
+enum sample_phase sample_access(unsigned int vpn)
+{
+	unsigned long n = nr_accesses++;
+	unsigned long window = n / sample_window;
+	unsigned long offset = n % sample_window;
+
+	switch (sampling_mode) {
+	case SAMPLING_SYSTEMATIC:
+		/* Sample the last window of every @sample_period windows */
+		if (window % sample_period == sample_period - 1) {
+			__start_sample(window, sample_period);
+			return SAMPLE_DETAIL;
+		}
+		if (window % sample_period == sample_period - 2 &&
+				offset + sample_warmup >= sample_window) {
+			return SAMPLE_WARMUP;
+		}
+		return SAMPLE_SKIP;
+
+	case SAMPLING_SIMPOINT:
+		if (window < nr_windows && simpoint_weights[window]) {
+			__start_sample(window, simpoint_weights[window]);
+			return SAMPLE_DETAIL;
+		}
+		if (window + 1 < nr_windows && simpoint_weights[window + 1] &&
+				offset + sample_warmup >= sample_window) {
+			return SAMPLE_WARMUP;
+		}
+		return SAMPLE_SKIP;
+
+	case SAMPLING_VPN:
+		if (__hash_vpn(vpn) % sample_period == 0) {
+			__start_vpn_sample(__hash_vpn(vpn) / sample_period % NR_VPN_GROUPS);
+			return SAMPLE_DETAIL;
+		}
+		return SAMPLE_WARMUP;
+
+	default:
+		return SAMPLE_DETAIL;
+	}
+}
+
+void record_sample(unsigned long nr_faults, unsigned long nr_tlb_misses,
+		unsigned long cycles)
+{
+	struct sample *sample = &samples[current_sample];
+
+	sample->nr_accesses++;
+	sample->nr_faults += nr_faults;
+	sample->nr_tlb_misses += nr_tlb_misses;
+	sample->cycles += cycles;
+}
+
+
+enum sample_stat {
+	STAT_FAULTS,
+	STAT_TLB_MISSES,
+	STAT_CYCLES,
+};
+
+static inline double __sample_stat(struct sample *sample, enum sample_stat stat)
+{
+	switch (stat) {
+	case STAT_FAULTS:
+		return sample->nr_faults;
+	case STAT_TLB_MISSES:
+		return sample->nr_tlb_misses;
+	default:
+		return sample->cycles;
+	}
+}
+
+/**
+ * Estimate the ratio of @stat to the accesses over the whole run with the
+ * ratio estimator, and its 95% confidence interval by the linearization.
+ */
+static void __estimate(enum sample_stat stat, double *ratio, double *error)
+{
+	double sum_x = 0.0, sum_a = 0.0, var = 0.0;
+
+	for (unsigned long i = 0; i < nr_samples; i++) {
+		struct sample *s = &samples[i];
+
+		sum_x += s->weight * __sample_stat(s, stat);
+		sum_a += s->weight * s->nr_accesses;
+	}
+	*ratio = sum_a ? sum_x / sum_a : 0.0;
+
+	for (unsigned long i = 0; i < nr_samples; i++) {
+		struct sample *s = &samples[i];
+		double d = __sample_stat(s, stat) - *ratio * s->nr_accesses;
+
+		var += s->weight * s->weight * d * d;
+	}
+	*error = (sum_a && nr_samples > 1) ?
+			1.96 * sqrt(var * nr_samples / (nr_samples - 1)) / sum_a : NAN;
+}
+
+static void __show_estimate(const char *name, enum sample_stat stat, bool percent)
+{
+	double ratio, error;
+
+	__estimate(stat, &ratio, &error);
+
+	fprintf(stderr, "%-9s: %.0f (+/- %.0f), ", name,
+			ratio * nr_accesses, error * nr_accesses);
+	if (percent) {
+		fprintf(stderr, "%.3f%% (+/- %.3f%%p) per access\n", ratio * 100, error * 100);
+	} else {
+		fprintf(stderr, "%.2f (+/- %.2f) per access\n", ratio, error);
+	}
+}
+
+void show_sampling_stats(void)
+{
+	unsigned long nr_detailed = 0;
+
+	for (unsigned long i = 0; i < nr_samples; i++) {
+		nr_detailed += samples[i].nr_accesses;
+	}
+
+	fprintf(stderr, "*** Sampling (%s) ***\n", sampling_names[sampling_mode]);
+	if (sampling_mode == SAMPLING_VPN) {
+		fprintf(stderr, "period   : 1 in %u VPNs in %d groups, others warmup\n",
+				sample_period, NR_VPN_GROUPS);
+	} else if (sampling_mode == SAMPLING_SIMPOINT) {
+		fprintf(stderr, "period   : %u of %lu windows of %lu accesses, %lu warmup\n",
+				nr_clusters, nr_windows, sample_window, sample_warmup);
+	} else {
+		fprintf(stderr, "period   : 1 in %u windows of %lu accesses, %lu warmup\n",
+				sample_period, sample_window, sample_warmup);
+	}
+	fprintf(stderr, "detailed : %lu of %lu accesses (%.2f%%) in %lu samples\n",
+			nr_detailed, nr_accesses,
+			nr_accesses ? nr_detailed * 100.0 / nr_accesses : 0.0, nr_samples);
+
+	fprintf(stderr, "estimated over the run (95%% confidence)\n");
+	__show_estimate("faults", STAT_FAULTS, true);
+	__show_estimate("TLB miss", STAT_TLB_MISSES, true);
+	__show_estimate("cycles", STAT_CYCLES, false);
+	fprintf(stderr, "\n");
+}
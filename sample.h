@@ -0,0 +1,120 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include <stdio.h>
+
+#include "types.h"
+
+/**
+ * Sampling of the memory accesses. The accesses are grouped into windows of
+ * @sample_window accesses. The accesses in the sampled windows are simulated
+ * in detail, the @sample_warmup accesses before them warm up the TLBs and the
+ * caches, and the others are fast-forwarded; they only update the page
+ * tables through the page faults. The statistics of the whole run are
+ * estimated from the sampled windows.
+ *
+ * - systematic: Sample every @sample_period-th window
+ * - simpoint  : Cluster the windows by their page-access signatures into
+ *               @sample_period clusters in a profiling pass, and sample the
+ *               window closest to the centroid of each cluster
+ * - vpn       : Sample the accesses to the VPNs hashed to 0 mod @sample_period.
+ *               The accesses to the other VPNs warm up the TLBs and the caches
+ *               as they compete with the sampled VPNs for them. The sampled
+ *               VPNs are split into NR_VPN_GROUPS groups, each a sample, so
+ *               that the confidence interval covers the choice of the VPNs
+ */
+enum sampling_mode {
+	SAMPLING_NONE,
+	SAMPLING_SYSTEMATIC,
+	SAMPLING_SIMPOINT,
+	SAMPLING_VPN,
+};
+
+enum sample_phase {
+	SAMPLE_DETAIL,
+	SAMPLE_WARMUP,
+	SAMPLE_SKIP,
+};
+
+#define DEFAULT_SAMPLE_PERIOD	10
+#define DEFAULT_SAMPLE_WINDOW	10000
+#define DEFAULT_SAMPLE_WARMUP	1000
+
+#define NR_VPN_GROUPS		8
+
+/* Dimension of the page-access signature of the windows */
+#define NR_SIGNATURE_BUCKETS	32
+#define MAX_KMEANS_ITERATIONS	32
+
+extern enum sampling_mode sampling_mode;
+extern unsigned int sample_period;
+extern unsigned long sample_window;
+extern unsigned long sample_warmup;
+
+/***********************************************************************
+ * parse_sampling()
+ *
+ * DESCRIPTION
+ *  Set the sampling mode from @spec, which is "systematic", "simpoint", or
+ *  "vpn" optionally followed by ":<period>".
+ *
+ * RETURN VALUE
+ *  Return @true on success
+ */
+bool parse_sampling(char *spec);
+
+/***********************************************************************
+ * profile_simpoints()
+ *
+ * DESCRIPTION
+ *  Profile the page-access signatures of the windows in @inputs, and choose
+ *  the windows to sample. The inputs are rewound for the simulation.
+ *
+ * RETURN VALUE
+ *  Return @true on success
+ *  Return @false if unable to read or rewind the inputs
+ */
+bool profile_simpoints(FILE *inputs[], unsigned int nr_inputs, unsigned int page_shift);
+
+/***********************************************************************
+ * sample_access()
+ *
+ * DESCRIPTION
+ *  Account an access to @vpn, and tell how to simulate it.
+ */
+enum sample_phase sample_access(unsigned int vpn);
+
+/***********************************************************************
+ * record_sample()
+ *
+ * DESCRIPTION
+ *  Record the page faults, TLB misses, and cycles of the access simulated in
+ *  detail.
+ */
+void record_sample(unsigned long nr_faults, unsigned long nr_tlb_misses,
+		unsigned long cycles);
+
+/***********************************************************************
+ * show_sampling_stats()
+ *
+ * DESCRIPTION
+ *  Show the statistics estimated from the samples with their 95% confidence
+ *  intervals.
+ */
+void show_sampling_stats(void);
+
+#endif
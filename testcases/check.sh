@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Run the testcases, and compare their outputs with the expected outputs in
+# testcases/expected. Run from the top directory as "make check".
+
+EXPECTED=testcases/expected
+OUTPUT=$(mktemp)
+VMZ=$(mktemp)
+SYNC_LOG=$(mktemp)
+RECORDED=$(mktemp)
+failed=0
+
+trap 'rm -f "$OUTPUT" "$VMZ" "$SYNC_LOG" "$RECORDED"' EXIT
+
+check() {
+	name=$1
+
+	if diff -u "$EXPECTED/$name.out" "$OUTPUT"; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+}
+
+run() {
+	name=$1
+
+	./vm "testcases/$name" > "$OUTPUT" 2>&1
+	check $name
+}
+
+# Coalesced TLB entries for the contiguous PTE runs
+run contig
+
+# Copy-on-write and reuse as the map counts drop over fork
+run cow-refcount
+
+# Map counts beyond the 8 bits go through the overflow table and back
+run mapcount-overflow
+
+# Commands of the files are merged by their timestamps
+./vm testcases/merge-0 testcases/merge-1 > "$OUTPUT" 2>&1
+check merge-order
+
+# The compressed trace runs the same as the plain one
+./vm -z testcases/fork > "$VMZ" && ./vm -q < "$VMZ" > "$OUTPUT" 2>&1
+check vmz
+
+# The fork storms end with the consistent counts on any number of CPUs
+for nr_cpus in 2 3; do
+	if timeout 300 ./vm -F $nr_cpus > "$OUTPUT" 2>&1; then
+		echo "PASS storm-$nr_cpus"
+	else
+		cat "$OUTPUT"
+		echo "FAIL storm-$nr_cpus"
+		failed=1
+	fi
+done
+
+# Replaying the log of the fork storms reproduces the counts of the recording
+timeout 300 ./vm -F 2 -R "record:$SYNC_LOG" > "$RECORDED" 2>&1 &&
+	timeout 300 ./vm -F 2 -R "replay:$SYNC_LOG" > "$OUTPUT" 2>&1
+if [ $? -eq 0 ] && diff -u "$RECORDED" "$OUTPUT"; then
+	echo "PASS storm-replay"
+else
+	echo "FAIL storm-replay"
+	failed=1
+fi
+
+exit $failed
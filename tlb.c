@@ -0,0 +1,113 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "tlb.h"
+
+static inline bool __covers(struct tlb_entry *te, unsigned int vpn)
+{
+	return te->valid && vpn >= te->vpn && vpn < te->vpn + te->nr_pages;
+}
+
+static void __evict_entry(struct tlb *tlb, struct tlb_entry *te)
+{
+	if (!te->valid) return;
+
+	te->valid = false;
+	tlb->reach -= te->nr_pages;
+}
+
+bool lookup_tlb(struct tlb *tlb, unsigned int rw, unsigned int vpn, unsigned int *pfn)
+{
+	tlb->clock++;
+	tlb->reach_sum += tlb->reach;
+
+	for (int i = 0; i < NR_TLB_ENTRIES; i++) {
+		struct tlb_entry *te = &tlb->entries[i];
+
+		if (!__covers(te, vpn)) continue;
+		if (rw == RW_WRITE && !te->writable) break;
+
+		te->lru = tlb->clock;
+		*pfn = te->pfn + (vpn - te->vpn);
+		tlb->nr_hits++;
+		return true;
+	}
+
+	tlb->nr_misses++;
+	return false;
+}
+
+void fill_tlb(struct tlb *tlb, unsigned int vpn, unsigned int base_vpn,
+		unsigned int base_pfn, unsigned int nr_pages, bool writable)
+{
+	struct tlb_entry *victim = &tlb->entries[0];
+
+	if (!tlb->coalesce) {
+		base_pfn += vpn - base_vpn;
+		base_vpn = vpn;
+		nr_pages = 1;
+	}
+
+	/* Drop stale entries for the range so that entries do not overlap */
+	for (int i = 0; i < NR_TLB_ENTRIES; i++) {
+		struct tlb_entry *te = &tlb->entries[i];
+
+		if (!te->valid) continue;
+		if (te->vpn < base_vpn + nr_pages && base_vpn < te->vpn + te->nr_pages) {
+			__evict_entry(tlb, te);
+		}
+	}
+
+	for (int i = 0; i < NR_TLB_ENTRIES; i++) {
+		struct tlb_entry *te = &tlb->entries[i];
+
+		if (!te->valid) {
+			victim = te;
+			break;
+		}
+		if (te->lru < victim->lru) victim = te;
+	}
+	__evict_entry(tlb, victim);
+
+	victim->valid = true;
+	victim->writable = writable;
+	victim->vpn = base_vpn;
+	victim->pfn = base_pfn;
+	victim->nr_pages = nr_pages;
+	victim->lru = tlb->clock;
+
+	tlb->reach += nr_pages;
+}
+
+void invalidate_tlb(struct tlb *tlb, unsigned int vpn)
+{
+	for (int i = 0; i < NR_TLB_ENTRIES; i++) {
+		struct tlb_entry *te = &tlb->entries[i];
+
+		if (__covers(te, vpn)) __evict_entry(tlb, te);
+	}
+}
+
+void flush_tlb(struct tlb *tlb)
+{
+	for (int i = 0; i < NR_TLB_ENTRIES; i++) {
+		__evict_entry(tlb, &tlb->entries[i]);
+	}
+}
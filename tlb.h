@@ -0,0 +1,96 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include "types.h"
+
+/* The number of entries in the TLB. The TLB is fully associative */
+#define NR_TLB_ENTRIES	8
+
+/* Latency of the TLB lookup and the range translation lookup in cycles */
+#define TLB_CYCLES	1
+#define RANGE_CYCLES	2
+
+/**
+ * A TLB entry translates @nr_pages consecutive VPNs starting from @vpn to
+ * the consecutive PFNs starting from @pfn. Ordinary entries cover a single
+ * page whereas coalesced entries cover the whole contiguous PTE run.
+ */
+struct tlb_entry {
+	bool valid;
+	bool writable;
+	unsigned int vpn;
+	unsigned int pfn;
+	unsigned int nr_pages;
+	unsigned long lru;	/* Time stamp of the last hit for LRU replacement */
+};
+
+struct tlb {
+	struct tlb_entry entries[NR_TLB_ENTRIES];
+	bool coalesce;		/* Fill contiguous PTE runs as a single entry */
+	unsigned long clock;
+
+	unsigned int reach;	/* The number of pages covered by valid entries */
+	unsigned long reach_sum;/* Sum of @reach sampled at each lookup */
+
+	unsigned long nr_hits;
+	unsigned long nr_misses;
+};
+
+
+/***********************************************************************
+ * lookup_tlb()
+ *
+ * DESCRIPTION
+ *  Look up @tlb for @vpn. The access for write (@rw == RW_WRITE) to a
+ *  read-only entry is considered as a miss so that the MMU walks the page
+ *  table and raises the page fault if needed.
+ *
+ * RETURN VALUE
+ *  Return @true and set @pfn on hit
+ *  Return @false otherwise
+ */
+bool lookup_tlb(struct tlb *tlb, unsigned int rw, unsigned int vpn, unsigned int *pfn);
+
+/***********************************************************************
+ * fill_tlb()
+ *
+ * DESCRIPTION
+ *  Insert the translation for @vpn into @tlb, evicting the least recently
+ *  used entry if necessary. When @tlb coalesces entries, the translation
+ *  covers @nr_pages pages starting from @base_vpn which is mapped to
+ *  @base_pfn. Otherwise, the entry covers @vpn only.
+ */
+void fill_tlb(struct tlb *tlb, unsigned int vpn, unsigned int base_vpn,
+		unsigned int base_pfn, unsigned int nr_pages, bool writable);
+
+/***********************************************************************
+ * invalidate_tlb()
+ *
+ * DESCRIPTION
+ *  Invalidate the entries in @tlb that cover @vpn.
+ */
+void invalidate_tlb(struct tlb *tlb, unsigned int vpn);
+
+/***********************************************************************
+ * flush_tlb()
+ *
+ * DESCRIPTION
+ *  Invalidate all entries in @tlb.
+ */
+void flush_tlb(struct tlb *tlb);
+
+#endif
@@ -0,0 +1,1096 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "types.h"
+#include "parser.h"
+#include "list_head.h"
+#include "vm.h"
+#include "trace.h"
+#include "perf.h"
+#include "vmz.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if VMZ_BLOCK_SIZE > TRACE_CHUNK_SIZE
+#error "A chunk should hold a VMZ block"
+#endif
+
+#define CACHELINE_SIZE	64
+
+/**
+ * Single-producer/single-consumer ring of fixed-size slots. The producer
+ * fills the slot at @head in place and publishes it by advancing @head, and
+ * the consumer releases the slot at @tail by advancing @tail. Each side keeps
+ * a cached copy of the other side's index so that it touches the shared
+ * cacheline only when the ring looks full or empty.
+ */
+struct ring {
+	unsigned long head __attribute__((aligned(CACHELINE_SIZE)));
+	unsigned long cached_tail;
+	bool closed;
+
+	unsigned long tail __attribute__((aligned(CACHELINE_SIZE)));
+	unsigned long cached_head;
+
+	unsigned int nr_slots;
+	size_t slot_size;
+	char *slots;
+};
+
+/**
+ * The reader fills @data after the head room, which receives the incomplete
+ * line carried from the previous chunk. The padding at the end lets the
+ * decoder read 64 bytes at a time.
+ */
+#define TRACE_CARRY_SIZE	MAX_COMMAND_LEN
+#define TRACE_PAD_SIZE		64
+
+struct trace_chunk {
+	size_t len;
+	char data[TRACE_CARRY_SIZE + TRACE_CHUNK_SIZE + TRACE_PAD_SIZE];
+};
+
+enum trace_format {
+	TRACE_TEXT,
+	TRACE_VMZ,
+	TRACE_GZIP,
+};
+
+/**
+ * A compressed trace goes through the decompressor thread. The reader puts
+ * the compressed chunks to @raw, and the decompressor puts the decompressed
+ * chunks to @chunks.
+ */
+struct trace {
+	int fd;
+	enum trace_format format;
+	unsigned char magic[VMZ_MAGIC_LEN];	/* Bytes read to find the format */
+	size_t nr_magic;
+
+	struct ring raw;
+	struct ring chunks;
+	struct ring ops;
+
+	/* Compressed chunk the decompressor is reading */
+	struct trace_chunk *raw_chunk;
+	size_t raw_pos;
+	unsigned char *block;	/* Compressed block of the built-in format */
+
+	unsigned long timestamp;	/* Timestamp of the last command */
+
+	/**
+	 * Inputs of the merged trace, and the min-heap of the inputs ordered by
+	 * the timestamps of their next ops. @heads are the next ops of the
+	 * inputs, and @last is the input of the op returned last.
+	 */
+	bool merged;
+	struct trace **inputs;
+	unsigned int nr_inputs;
+	struct trace_op **heads;
+	unsigned int *heap;
+	unsigned int nr_heap;
+	int last;
+
+	bool holding_op;	/* The simulator holds the op at the tail */
+	pthread_t reader;
+	pthread_t decompressor;
+	pthread_t decoder;
+};
+
+static bool __init_ring(struct ring *ring, unsigned int nr_slots, size_t slot_size)
+{
+	memset(ring, 0x00, sizeof(*ring));
+	ring->nr_slots = nr_slots;
+	ring->slot_size = slot_size;
+	ring->slots = malloc(nr_slots * slot_size);
+
+	return ring->slots != NULL;
+}
+
+/**
+ * Spin for a while, and then sleep not to burn the CPU when the other side
+ * is blocked for a long time (e.g., reading the command from the terminal).
+ */
+static void __wait_ring(unsigned int *nr_waits)
+{
+	static const struct timespec backoff = { .tv_nsec = 100000 };
+
+	pthread_testcancel();
+	if (++*nr_waits < 64) {
+		sched_yield();
+	} else {
+		nanosleep(&backoff, NULL);
+	}
+}
+
+static void *__produce_slot(struct ring *ring)
+{
+	unsigned int nr_waits = 0;
+
+	while (ring->head - ring->cached_tail == ring->nr_slots) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head - ring->cached_tail < ring->nr_slots) break;
+		__wait_ring(&nr_waits);
+	}
+	return ring->slots + (ring->head % ring->nr_slots) * ring->slot_size;
+}
+
+static void __publish_slot(struct ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void __close_ring(struct ring *ring)
+{
+	__atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+static void *__consume_slot(struct ring *ring)
+{
+	unsigned int nr_waits = 0;
+
+	while (ring->tail == ring->cached_head) {
+		bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail != ring->cached_head) break;
+		if (closed) return NULL;
+		__wait_ring(&nr_waits);
+	}
+	return ring->slots + (ring->tail % ring->nr_slots) * ring->slot_size;
+}
+
+static void __release_slot(struct ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+static void *__read_trace(void *arg)
+{
+	struct trace *trace = arg;
+	struct ring *ring = trace->format == TRACE_TEXT ? &trace->chunks : &trace->raw;
+
+	while (true) {
+		struct trace_chunk *chunk = __produce_slot(ring);
+		char *data = chunk->data + TRACE_CARRY_SIZE;
+		ssize_t len;
+
+		/* The bytes read to find the format come first */
+		memcpy(data, trace->magic, trace->nr_magic);
+		len = read(trace->fd, data + trace->nr_magic, TRACE_CHUNK_SIZE - trace->nr_magic);
+
+		if (len < 0) perror("read");
+		if (len <= 0 && !trace->nr_magic) break;
+
+		chunk->len = (len > 0 ? len : 0) + trace->nr_magic;
+		trace->nr_magic = 0;
+		__publish_slot(ring);
+	}
+	__close_ring(ring);
+
+	return NULL;
+}
+
+/**
+ * Read @len bytes of the compressed trace into @buf.
+ *
+ * RETURN
+ *   The number of bytes read, which is less than @len at the end of the trace
+ */
+static size_t __read_raw(struct trace *trace, void *buf, size_t len)
+{
+	size_t copied = 0;
+
+	while (copied < len) {
+		size_t n;
+
+		if (!trace->raw_chunk) {
+			trace->raw_chunk = __consume_slot(&trace->raw);
+			trace->raw_pos = 0;
+			if (!trace->raw_chunk) break;
+		}
+
+		n = trace->raw_chunk->len - trace->raw_pos;
+		if (n > len - copied) n = len - copied;
+
+		memcpy((char *)buf + copied,
+				trace->raw_chunk->data + TRACE_CARRY_SIZE + trace->raw_pos, n);
+		copied += n;
+		trace->raw_pos += n;
+
+		if (trace->raw_pos == trace->raw_chunk->len) {
+			__release_slot(&trace->raw);
+			trace->raw_chunk = NULL;
+		}
+	}
+	return copied;
+}
+
+static inline uint32_t __get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Decompress the trace in the built-in format. Each block is decompressed
+ * into a chunk in place.
+ */
+static void *__decompress_vmz(void *arg)
+{
+	struct trace *trace = arg;
+	unsigned char *block = trace->block;
+	unsigned char header[VMZ_HEADER_SIZE];
+	size_t len;
+
+	if (__read_raw(trace, header, VMZ_MAGIC_LEN) != VMZ_MAGIC_LEN) goto out;
+
+	while ((len = __read_raw(trace, header, sizeof(header)))) {
+		uint32_t raw_len = __get32(header);
+		uint32_t compressed = __get32(header + 4) & ~VMZ_STORED;
+		bool stored = __get32(header + 4) & VMZ_STORED;
+		struct trace_chunk *chunk;
+		char *data;
+
+		if (len != sizeof(header) || raw_len > VMZ_BLOCK_SIZE ||
+				compressed > VMZ_BOUND(VMZ_BLOCK_SIZE) || (stored && compressed != raw_len) ||
+				__read_raw(trace, block, compressed) != compressed) {
+			fprintf(stderr, "Corrupted trace block\n");
+			break;
+		}
+
+		chunk = __produce_slot(&trace->chunks);
+		data = chunk->data + TRACE_CARRY_SIZE;
+		if (stored) {
+			memcpy(data, block, raw_len);
+		} else if (vmz_decompress_block(block, compressed,
+					(unsigned char *)data, raw_len) != raw_len) {
+			fprintf(stderr, "Corrupted trace block\n");
+			break;
+		}
+		chunk->len = raw_len;
+		__publish_slot(&trace->chunks);
+	}
+
+out:
+	__close_ring(&trace->chunks);
+	return NULL;
+}
+
+#ifdef HAVE_ZLIB
+static void __end_inflate(void *stream)
+{
+	inflateEnd(stream);
+}
+
+/**
+ * Decompress the gzip or zlib stream. Concatenated gzip members are
+ * decompressed one after another as gzip does.
+ */
+static void *__decompress_gzip(void *arg)
+{
+	struct trace *trace = arg;
+	z_stream stream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	struct trace_chunk *in = NULL;
+	struct trace_chunk *out = NULL;
+	bool in_member = false;
+
+	/* Detect the gzip and zlib headers automatically */
+	if (inflateInit2(&stream, 15 + 32) != Z_OK) goto out;
+
+	pthread_cleanup_push(__end_inflate, &stream);
+
+	while (true) {
+		int ret;
+
+		if (!stream.avail_in) {
+			if (in) __release_slot(&trace->raw);
+			in = __consume_slot(&trace->raw);
+			if (!in) break;
+
+			stream.next_in = (unsigned char *)in->data + TRACE_CARRY_SIZE;
+			stream.avail_in = in->len;
+		}
+		if (!out) {
+			out = __produce_slot(&trace->chunks);
+			stream.next_out = (unsigned char *)out->data + TRACE_CARRY_SIZE;
+			stream.avail_out = TRACE_CHUNK_SIZE;
+		}
+
+		ret = inflate(&stream, Z_NO_FLUSH);
+		in_member = true;
+
+		if (ret == Z_STREAM_END) {
+			inflateReset(&stream);
+			in_member = false;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "Corrupted trace: %s\n", stream.msg ? stream.msg : "unknown");
+			break;
+		}
+
+		if (!stream.avail_out) {
+			out->len = TRACE_CHUNK_SIZE;
+			__publish_slot(&trace->chunks);
+			out = NULL;
+		}
+	}
+
+	if (out && stream.avail_out < TRACE_CHUNK_SIZE) {
+		out->len = TRACE_CHUNK_SIZE - stream.avail_out;
+		__publish_slot(&trace->chunks);
+	}
+	if (!in && in_member) fprintf(stderr, "Truncated trace\n");
+
+	pthread_cleanup_pop(true);
+out:
+	__close_ring(&trace->chunks);
+	return NULL;
+}
+#endif
+
+/**
+ * Find the format of the trace from its first bytes. A terminal may give a
+ * short line, so stop reading at the newline.
+ */
+static bool __probe_format(struct trace *trace)
+{
+	while (trace->nr_magic < VMZ_MAGIC_LEN &&
+			!memchr(trace->magic, '\n', trace->nr_magic)) {
+		ssize_t len = read(trace->fd, trace->magic + trace->nr_magic,
+				VMZ_MAGIC_LEN - trace->nr_magic);
+
+		if (len < 0) perror("read");
+		if (len <= 0) break;
+		trace->nr_magic += len;
+	}
+
+	trace->format = TRACE_TEXT;
+	if (trace->nr_magic == VMZ_MAGIC_LEN &&
+			memcmp(trace->magic, VMZ_MAGIC, VMZ_MAGIC_LEN) == 0) {
+		trace->format = TRACE_VMZ;
+	} else if (trace->nr_magic >= 2 &&
+			trace->magic[0] == 0x1f && trace->magic[1] == 0x8b) {
+		trace->format = TRACE_GZIP;
+#ifndef HAVE_ZLIB
+		fprintf(stderr, "Compressed trace requires zlib (make ZLIB=1)\n");
+		return false;
+#endif
+	}
+	return true;
+}
+
+
+/**
+ * Commands are looked up with a perfect hash over the first and the last
+ * characters, the length, and the number of tokens of the command. The hash
+ * has no collision for the commands below, which open_trace() verifies.
+ */
+#define COMMAND_HASH_SIZE	64
+#define MAX_COMMAND_NAME	16
+
+static const struct {
+	const char *name;
+	int nr_tokens;
+	enum trace_opcode opcode;
+} commands[] = {
+	{ "exit", 1, TRACE_EXIT },
+	{ "show", 1, TRACE_SHOW },
+	{ "pages", 1, TRACE_PAGES },
+	{ "ranges", 1, TRACE_RANGES },
+	{ "guests", 1, TRACE_GUESTS },
+	{ "balloon", 1, TRACE_BALANCE },
+	{ "stats", 1, TRACE_STATS },
+	{ "help", 1, TRACE_HELP },
+	{ "?", 1, TRACE_HELP },
+
+	{ "switch", 2, TRACE_SWITCH },
+	{ "s", 2, TRACE_SWITCH },
+	{ "stats", 2, TRACE_PROCESS_STATS },
+	{ "free", 2, TRACE_FREE },
+	{ "f", 2, TRACE_FREE },
+	{ "read", 2, TRACE_READ },
+	{ "r", 2, TRACE_READ },
+	{ "write", 2, TRACE_WRITE },
+	{ "w", 2, TRACE_WRITE },
+	{ "memadd", 2, TRACE_MEMADD },
+	{ "load", 2, TRACE_LOAD },
+	{ "store", 2, TRACE_STORE },
+
+	{ "alloc", 3, TRACE_ALLOC },
+	{ "a", 3, TRACE_ALLOC },
+	{ "access", 3, TRACE_ACCESS },
+	{ "guest", 3, TRACE_GUEST },
+	{ "balloon", 3, TRACE_INFLATE },
+	{ "deflate", 3, TRACE_DEFLATE },
+	{ "memremove", 3, TRACE_MEMREMOVE },
+};
+
+/* Index to commands[] + 1, and 0 for the empty bucket */
+static unsigned char command_hash[COMMAND_HASH_SIZE];
+
+static inline unsigned int __hash_command(const char *name, size_t len, int nr_tokens)
+{
+	const unsigned char *c = (const unsigned char *)name;
+
+	return (c[0] + 2 * c[len - 1] + 2 * len + 4 * nr_tokens) % COMMAND_HASH_SIZE;
+}
+
+static bool __init_command_hash(void)
+{
+	if (command_hash[0]) return true;
+
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		unsigned int hash = __hash_command(commands[i].name,
+				strlen(commands[i].name), commands[i].nr_tokens);
+
+		if (command_hash[hash]) {
+			fprintf(stderr, "Command hash collides on %s\n", commands[i].name);
+			return false;
+		}
+		command_hash[hash] = i + 1;
+	}
+	return true;
+}
+
+static enum trace_opcode __lookup_command(const char *name, size_t len, int nr_tokens)
+{
+	unsigned int index = command_hash[__hash_command(name, len, nr_tokens)];
+
+	if (!index--) return TRACE_UNKNOWN;
+	if (commands[index].nr_tokens != nr_tokens ||
+			strncmp(commands[index].name, name, len) ||
+			commands[index].name[len] != '\0') {
+		return TRACE_UNKNOWN;
+	}
+	return commands[index].opcode;
+}
+
+static inline char __lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static unsigned int __make_rwflag(const char *rw, size_t len)
+{
+	unsigned int rwflag = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (rw[i] == 'r' || rw[i] == 'R') {
+			rwflag |= RW_READ;
+		}
+		if (rw[i] == 'w' || rw[i] == 'W') {
+			rwflag |= RW_WRITE;
+		}
+	}
+	return rwflag;
+}
+
+/**
+ * Parse @len (up to 8) decimal digits at once. The digits are right-aligned
+ * in a word padded with '0's, and the adjacent digits are combined pairwise.
+ *
+ * RETURN
+ *   @false if there is a non-digit character
+ */
+static inline bool __parse_decimal8(const char *str, size_t len, unsigned long *value)
+{
+	const uint64_t zeros = 0x3030303030303030ULL;
+	uint64_t word = zeros;
+
+	memcpy((char *)&word + 8 - len, str, len);
+	word -= zeros;
+	if ((word | (word + 0x7676767676767676ULL)) & 0x8080808080808080ULL) {
+		return false;
+	}
+
+	word = (word * 10 + (word >> 8)) & 0x00ff00ff00ff00ffULL;
+	word = (word * 100 + (word >> 16)) & 0x0000ffff0000ffffULL;
+	word = (word * 10000 + (word >> 32)) & 0x00000000ffffffffULL;
+
+	*value = word;
+	return true;
+}
+
+/**
+ * Parse the number @str of @len bytes as strtoimax() and strtoumax() do with
+ * base 0. Numbers that may overflow are left to them; @str[@len] should be
+ * writable to terminate the number for them.
+ */
+#define MAX_FAST_DIGITS	15
+
+static unsigned long __parse_number(char *str, size_t len, bool is_unsigned)
+{
+	static const signed char digits[256] = {
+		['0'] = 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+		['a'] = 11, 12, 13, 14, 15, 16,
+		['A'] = 11, 12, 13, 14, 15, 16,
+	};
+	unsigned long value = 0;
+	unsigned int base = 10;
+	bool negative = false;
+	size_t i = 0, nr_digits = 0;
+
+	if (i < len && (str[i] == '+' || str[i] == '-')) {
+		negative = (str[i++] == '-');
+	}
+	if (i < len && str[i] == '0') {
+		base = 8;
+		if (i + 2 < len && (str[i + 1] | 0x20) == 'x' &&
+				digits[(unsigned char)str[i + 2]]) {
+			base = 16;
+			i += 2;
+		}
+	}
+
+	if (base == 10 && len - i <= 8 && len > i &&
+			__parse_decimal8(str + i, len - i, &value)) {
+		return negative ? -value : value;
+	}
+
+	for (; i < len; i++, nr_digits++) {
+		unsigned int digit = digits[(unsigned char)str[i]];
+
+		if (!digit || digit > base) break;
+		if (nr_digits == MAX_FAST_DIGITS) {
+			char saved = str[len];
+
+			str[len] = '\0';
+			value = is_unsigned ? strtoumax(str, NULL, 0) :
+					(unsigned long)strtoimax(str, NULL, 0);
+			str[len] = saved;
+			return value;
+		}
+		value = value * base + digit - 1;
+	}
+
+	return negative ? -value : value;
+}
+
+/**
+ * Decode the command of @nr_tokens tokens into @op. The tokens are given as
+ * the pointers to the tokens and their lengths.
+ */
+static void __decode_op(struct trace_op *op, int nr_tokens, char *tokens[], size_t lens[])
+{
+	char name[MAX_COMMAND_NAME];
+	size_t len = lens[0] < sizeof(name) ? lens[0] : sizeof(name);
+
+	op->rw = 0;
+	op->args[0] = op->args[1] = 0;
+
+	if (nr_tokens > 3) {
+		op->opcode = TRACE_INVALID;
+		return;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		name[i] = __lower(tokens[0][i]);
+	}
+	op->opcode = lens[0] < sizeof(name) ?
+			__lookup_command(name, len, nr_tokens) : TRACE_UNKNOWN;
+
+	if (op->opcode == TRACE_UNKNOWN) {
+		len = lens[0] < sizeof(op->name) ? lens[0] : sizeof(op->name) - 1;
+		for (size_t i = 0; i < len; i++) {
+			op->name[i] = __lower(tokens[0][i]);
+		}
+		op->name[len] = '\0';
+		return;
+	}
+
+	if (nr_tokens >= 2) {
+		bool is_address = (op->opcode == TRACE_LOAD || op->opcode == TRACE_STORE);
+
+		op->args[0] = __parse_number(tokens[1], lens[1], is_address);
+		if (!is_address) op->args[0] = (unsigned int)op->args[0];
+	}
+	if (nr_tokens == 3) {
+		op->rw = __make_rwflag(tokens[2], lens[2]);
+		op->args[1] = (unsigned int)__parse_number(tokens[2], lens[2], false);
+	}
+}
+
+/**
+ * Decode the command of @nr_tokens tokens for the simulator. A command may be
+ * prefixed by its timestamp as "@<timestamp>", and the commands without the
+ * timestamp are at the time of the previous command.
+ */
+static void __emit_op(struct trace *trace, int nr_tokens, char *tokens[], size_t lens[])
+{
+	struct trace_op *op;
+
+	if (tokens[0][0] == '@') {
+		trace->timestamp = __parse_number(tokens[0] + 1, lens[0] - 1, true);
+		if (!--nr_tokens) return;
+		tokens++;
+		lens++;
+	}
+
+	op = __produce_slot(&trace->ops);
+	op->timestamp = trace->timestamp;
+	op->cpu = 0;
+	__decode_op(op, nr_tokens, tokens, lens);
+	__publish_slot(&trace->ops);
+}
+
+/**
+ * Decode @command with parse_command(). This is the reference decoder, and
+ * is used for the lines the fast decoder does not deal with.
+ */
+static void __decode_command(struct trace *trace, char *command)
+{
+	char *tokens[MAX_NR_TOKENS] = { NULL };
+	size_t lens[MAX_NR_TOKENS];
+	int nr_tokens = 0;
+
+	if (!parse_command(command, &nr_tokens, tokens)) return;
+
+	for (int i = 0; i < nr_tokens && i < 4; i++) {
+		lens[i] = strlen(tokens[i]);
+	}
+	__emit_op(trace, nr_tokens, tokens, lens);
+}
+
+/**
+ * Decode @len bytes from @line as fgets() would split them; a line longer
+ * than the command buffer is split into commands of MAX_COMMAND_LEN - 1
+ * bytes, and a command ends at the null character.
+ */
+static void __decode_slow(struct trace *trace, const char *line, size_t len)
+{
+	char command[MAX_COMMAND_LEN];
+
+	for (size_t i = 0; i < len; ) {
+		const char *eol = memchr(line + i, '\n', len - i);
+		size_t n = (eol ? eol + 1 - line : len) - i;
+
+		if (n > sizeof(command) - 1) n = sizeof(command) - 1;
+
+		memcpy(command, line + i, n);
+		command[n] = '\0';
+		__decode_command(trace, command);
+		i += n;
+	}
+}
+
+/**
+ * __classify()
+ *
+ * Find the whitespaces (as isspace() in the C locale) and the newlines in the
+ * 64 bytes from @block. Bit i of the masks stands for @block[i].
+ */
+static inline void __classify(const char *block, uint64_t *ws, uint64_t *nl)
+{
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i four = _mm_set1_epi8(4);
+
+	*ws = *nl = 0;
+	for (int i = 0; i < 64; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+		/* '\t', '\n', '\v', '\f', and '\r' are from 9 to 13 */
+		__m128i ctrl = _mm_sub_epi8(v, tab);
+		__m128i is_ctrl = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, four), ctrl);
+		__m128i is_ws = _mm_or_si128(is_ctrl, _mm_cmpeq_epi8(v, space));
+
+		*ws |= (uint64_t)(unsigned int)_mm_movemask_epi8(is_ws) << i;
+		*nl |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << i;
+	}
+#else
+	*ws = *nl = 0;
+	for (int i = 0; i < 64; i++) {
+		unsigned char c = block[i];
+
+		if (c == ' ' || (unsigned char)(c - '\t') <= 4) *ws |= 1ULL << i;
+		if (c == '\n') *nl |= 1ULL << i;
+	}
+#endif
+}
+
+/**
+ * Tokens of the line being scanned by __decode_lines()
+ */
+struct line {
+	char *start;
+	int nr_tokens;
+	char *tokens[5];	/* Timestamp and up to four tokens */
+	size_t lens[5];
+	bool open;	/* The last token continues to the next block */
+	bool done;	/* The rest of the line is a comment or is not needed */
+};
+
+static inline void __reset_line(struct line *line, char *start)
+{
+	line->start = start;
+	line->nr_tokens = 0;
+	line->open = false;
+	line->done = false;
+}
+
+static void __finish_line(struct trace *trace, struct line *line, char *eol)
+{
+	size_t len = eol + 1 - line->start;
+
+	if (len > MAX_COMMAND_LEN - 1) {
+		__decode_slow(trace, line->start, len);
+		return;
+	}
+	if (!line->nr_tokens) return;
+
+	__emit_op(trace, line->nr_tokens, line->tokens, line->lens);
+}
+
+/**
+ * __decode_lines()
+ *
+ * Decode the complete lines in [@start, @end) 64 bytes at a time. The token
+ * boundaries and the newlines are found from the whitespace masks of each
+ * block. The 64 bytes from @end should be readable.
+ *
+ * RETURN
+ *   The start of the incomplete line at the end
+ */
+static char *__decode_lines(struct trace *trace, char *start, char *end)
+{
+	struct line line;
+	uint64_t prev_ws = 1;
+
+	__reset_line(&line, start);
+
+	for (char *block = start; block < end; block += 64) {
+		uint64_t ws, nl, starts, events;
+
+		__classify(block, &ws, &nl);
+		if (end - block < 64) {
+			uint64_t valid = (1ULL << (end - block)) - 1;
+
+			ws |= ~valid;
+			nl &= valid;
+		}
+
+		if (line.open && ws) {
+			line.lens[line.nr_tokens - 1] =
+				block + __builtin_ctzll(ws) - line.tokens[line.nr_tokens - 1];
+			line.open = false;
+		}
+
+		starts = ~ws & ((ws << 1) | prev_ws);
+		prev_ws = ws >> 63;
+
+		for (events = starts | nl; events; events &= events - 1) {
+			unsigned int i = __builtin_ctzll(events);
+			uint64_t after;
+			int n;
+
+			if (nl & (1ULL << i)) {
+				__finish_line(trace, &line, block + i);
+				__reset_line(&line, block + i + 1);
+				continue;
+			}
+			if (line.done) continue;
+			if (block[i] == '#') {
+				line.done = true;
+				continue;
+			}
+
+			n = line.nr_tokens++;
+			line.tokens[n] = block + i;
+			after = ws & ~((2ULL << i) - 1);
+			if (after) {
+				line.lens[n] = __builtin_ctzll(after) - i;
+			} else {
+				line.open = true;
+			}
+			/* A fourth token makes the command invalid anyway */
+			if (line.nr_tokens == (line.tokens[0][0] == '@' ? 5 : 4)) {
+				line.done = true;
+			}
+		}
+	}
+
+	return line.start;
+}
+
+static void __close_perf_counters(void *arg)
+{
+	close_perf_counters();
+}
+
+/**
+ * Decode the chunks. The incomplete line at the end of a chunk is carried to
+ * the head room of the next chunk. The decoder is cancelled when the trace is
+ * closed before the end, so the counters are closed by the cleanup handler.
+ */
+static void *__decode_trace(void *arg)
+{
+	struct trace *trace = arg;
+	char carry[TRACE_CARRY_SIZE];
+	size_t nr_carry = 0;
+	struct trace_chunk *chunk;
+	struct perf_sample sample;
+
+	open_perf_counters();
+	pthread_cleanup_push(__close_perf_counters, NULL);
+
+	while ((chunk = __consume_slot(&trace->chunks))) {
+		char *start = chunk->data + TRACE_CARRY_SIZE - nr_carry;
+		char *end = chunk->data + TRACE_CARRY_SIZE + chunk->len;
+		char *rest;
+
+		perf_begin(PERF_PARSE, &sample);
+		memcpy(start, carry, nr_carry);
+
+		if (memchr(start, '\0', end - start)) {
+			char *eol = memrchr(start, '\n', end - start);
+
+			rest = eol ? eol + 1 : start;
+			__decode_slow(trace, start, rest - start);
+		} else {
+			rest = __decode_lines(trace, start, end);
+		}
+
+		while (end - rest >= MAX_COMMAND_LEN - 1) {
+			__decode_slow(trace, rest, MAX_COMMAND_LEN - 1);
+			rest += MAX_COMMAND_LEN - 1;
+		}
+		nr_carry = end - rest;
+		memcpy(carry, rest, nr_carry);
+		perf_end(PERF_PARSE, &sample);
+
+		__release_slot(&trace->chunks);
+	}
+
+	if (nr_carry) __decode_slow(trace, carry, nr_carry);
+	__close_ring(&trace->ops);
+
+	pthread_cleanup_pop(true);
+	return NULL;
+}
+
+
+static void __cancel_stage(pthread_t thread)
+{
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+}
+
+struct trace *open_trace(FILE *input)
+{
+	struct trace *trace = calloc(1, sizeof(*trace));
+
+	if (!trace) return NULL;
+	if (!__init_command_hash()) goto out_free;
+
+	trace->fd = fileno(input);
+	if (!__probe_format(trace)) goto out_free;
+
+	if (!__init_ring(&trace->chunks, NR_TRACE_CHUNKS, sizeof(struct trace_chunk)) ||
+			!__init_ring(&trace->ops, NR_TRACE_OPS, sizeof(struct trace_op))) {
+		goto out_free;
+	}
+	if (trace->format != TRACE_TEXT &&
+			!__init_ring(&trace->raw, NR_TRACE_CHUNKS, sizeof(struct trace_chunk))) {
+		goto out_free;
+	}
+	if (trace->format == TRACE_VMZ &&
+			!(trace->block = malloc(VMZ_BOUND(VMZ_BLOCK_SIZE)))) {
+		goto out_free;
+	}
+
+	if (pthread_create(&trace->reader, NULL, __read_trace, trace)) {
+		goto out_free;
+	}
+	if (trace->format != TRACE_TEXT) {
+		void *(*decompress)(void *) = __decompress_vmz;
+#ifdef HAVE_ZLIB
+		if (trace->format == TRACE_GZIP) decompress = __decompress_gzip;
+#endif
+		if (pthread_create(&trace->decompressor, NULL, decompress, trace)) {
+			__cancel_stage(trace->reader);
+			goto out_free;
+		}
+	}
+	if (pthread_create(&trace->decoder, NULL, __decode_trace, trace)) {
+		__cancel_stage(trace->reader);
+		if (trace->format != TRACE_TEXT) __cancel_stage(trace->decompressor);
+		goto out_free;
+	}
+
+	return trace;
+
+out_free:
+	free(trace->block);
+	free(trace->raw.slots);
+	free(trace->chunks.slots);
+	free(trace->ops.slots);
+	free(trace);
+	return NULL;
+}
+
+/**
+ * The ops at the same time are taken from the inputs in the order of the
+ * inputs, which keeps the merge deterministic.
+ */
+static inline bool __heap_before(struct trace *trace, unsigned int a, unsigned int b)
+{
+	struct trace_op *x = trace->heads[a];
+	struct trace_op *y = trace->heads[b];
+
+	return x->timestamp < y->timestamp || (x->timestamp == y->timestamp && a < b);
+}
+
+static void __sift_down(struct trace *trace, unsigned int pos)
+{
+	unsigned int *heap = trace->heap;
+
+	while (true) {
+		unsigned int min = pos;
+		unsigned int left = 2 * pos + 1;
+		unsigned int right = left + 1;
+		unsigned int tmp;
+
+		if (left < trace->nr_heap && __heap_before(trace, heap[left], heap[min])) {
+			min = left;
+		}
+		if (right < trace->nr_heap && __heap_before(trace, heap[right], heap[min])) {
+			min = right;
+		}
+		if (min == pos) break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[min];
+		heap[min] = tmp;
+		pos = min;
+	}
+}
+
+static struct trace_op *__next_merged_op(struct trace *trace)
+{
+	unsigned int input;
+
+	/* Replace the input of the last op with its next op */
+	if (trace->last >= 0) {
+		struct trace_op *op = next_trace_op(trace->inputs[trace->last]);
+
+		if (op) {
+			op->cpu = trace->last;
+			trace->heads[trace->last] = op;
+		} else {
+			trace->heap[0] = trace->heap[--trace->nr_heap];
+		}
+		if (trace->nr_heap) __sift_down(trace, 0);
+	}
+	if (!trace->nr_heap) return NULL;
+
+	input = trace->heap[0];
+	trace->last = input;
+
+	return trace->heads[input];
+}
+
+struct trace *open_merged_trace(FILE *inputs[], unsigned int nr_inputs)
+{
+	struct trace *trace = calloc(1, sizeof(*trace));
+
+	if (!trace) return NULL;
+
+	trace->merged = true;
+	trace->inputs = calloc(nr_inputs, sizeof(*trace->inputs));
+	trace->heads = calloc(nr_inputs, sizeof(*trace->heads));
+	trace->heap = calloc(nr_inputs, sizeof(*trace->heap));
+	if (!trace->inputs || !trace->heads || !trace->heap) goto out_close;
+
+	for (unsigned int i = 0; i < nr_inputs; i++) {
+		trace->inputs[i] = open_trace(inputs[i]);
+		if (!trace->inputs[i]) goto out_close;
+		trace->nr_inputs++;
+	}
+
+	/* Take the first op of each input, and heapify them */
+	for (unsigned int i = 0; i < nr_inputs; i++) {
+		struct trace_op *op = next_trace_op(trace->inputs[i]);
+
+		if (!op) continue;
+		op->cpu = i;
+		trace->heads[i] = op;
+		trace->heap[trace->nr_heap++] = i;
+	}
+	for (int i = trace->nr_heap / 2 - 1; i >= 0; i--) {
+		__sift_down(trace, i);
+	}
+	trace->last = -1;
+
+	return trace;
+
+out_close:
+	close_trace(trace);
+	return NULL;
+}
+
+struct trace_op *next_trace_op(struct trace *trace)
+{
+	struct trace_op *op;
+
+	if (trace->merged) return __next_merged_op(trace);
+
+	if (trace->holding_op) __release_slot(&trace->ops);
+
+	op = __consume_slot(&trace->ops);
+	trace->holding_op = (op != NULL);
+
+	return op;
+}
+
+void close_trace(struct trace *trace)
+{
+	if (trace->merged) {
+		for (unsigned int i = 0; i < trace->nr_inputs; i++) {
+			close_trace(trace->inputs[i]);
+		}
+		free(trace->inputs);
+		free(trace->heads);
+		free(trace->heap);
+		free(trace);
+		return;
+	}
+
+	__cancel_stage(trace->reader);
+	if (trace->format != TRACE_TEXT) __cancel_stage(trace->decompressor);
+	__cancel_stage(trace->decoder);
+
+	free(trace->block);
+	free(trace->raw.slots);
+	free(trace->chunks.slots);
+	free(trace->ops.slots);
+	free(trace);
+}
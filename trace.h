@@ -0,0 +1,126 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+#include "types.h"
+#include "parser.h"
+
+/**
+ * The trace is ingested in a pipeline. The reader thread reads the input in
+ * TRACE_CHUNK_SIZE chunks, and the decoder thread decodes the chunks into
+ * trace operations for the simulator. The stages are connected by
+ * single-producer/single-consumer rings.
+ */
+#define TRACE_CHUNK_SIZE	(64 << 10)
+#define NR_TRACE_CHUNKS		16
+#define NR_TRACE_OPS		1024
+
+enum trace_opcode {
+	TRACE_EXIT,
+	TRACE_SHOW,
+	TRACE_PAGES,
+	TRACE_RANGES,
+	TRACE_GUESTS,
+	TRACE_BALANCE,
+	TRACE_STATS,
+	TRACE_HELP,
+
+	TRACE_SWITCH,
+	TRACE_PROCESS_STATS,
+	TRACE_FREE,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_MEMADD,
+	TRACE_LOAD,
+	TRACE_STORE,
+
+	TRACE_ALLOC,
+	TRACE_ACCESS,
+	TRACE_GUEST,
+	TRACE_INFLATE,
+	TRACE_DEFLATE,
+	TRACE_MEMREMOVE,
+
+	TRACE_UNKNOWN,	/* @name is not a command */
+	TRACE_INVALID,	/* Too many tokens */
+};
+
+/**
+ * Decoded command. @args are the arguments in the order of the command,
+ * and @rw is the rw flag of alloc and access. @timestamp is given by the
+ * "@<timestamp>" prefix of the command or its preceding commands.
+ */
+struct trace_op {
+	enum trace_opcode opcode;
+	unsigned int cpu;		/* Input of a merged trace */
+	unsigned long timestamp;
+	unsigned int rw;
+	unsigned long args[2];
+	char name[MAX_TOKEN_LEN];
+};
+
+struct trace;
+
+/***********************************************************************
+ * open_trace()
+ *
+ * DESCRIPTION
+ *  Start ingesting the trace from @input.
+ *
+ * RETURN VALUE
+ *  Return the trace on success
+ *  Return NULL if unable to start the pipeline
+ */
+struct trace *open_trace(FILE *input);
+
+/***********************************************************************
+ * open_merged_trace()
+ *
+ * DESCRIPTION
+ *  Start ingesting the traces from @inputs, and merge them into a single
+ *  trace by the timestamps of the commands. Each input is ingested in its
+ *  own pipeline, and the @cpu of the ops tells the input they come from.
+ *
+ * RETURN VALUE
+ *  Return the merged trace on success
+ *  Return NULL if unable to start the pipelines
+ */
+struct trace *open_merged_trace(FILE *inputs[], unsigned int nr_inputs);
+
+/***********************************************************************
+ * next_trace_op()
+ *
+ * DESCRIPTION
+ *  Get the next operation of @trace. The operation remains valid until the
+ *  next call.
+ *
+ * RETURN VALUE
+ *  Return the operation
+ *  Return NULL at the end of the trace
+ */
+struct trace_op *next_trace_op(struct trace *trace);
+
+/***********************************************************************
+ * close_trace()
+ *
+ * DESCRIPTION
+ *  Stop ingesting @trace even if it has more operations, and release it.
+ */
+void close_trace(struct trace *trace);
+
+#endif
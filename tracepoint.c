@@ -0,0 +1,173 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "types.h"
+#include "tracepoint.h"
+
+unsigned char tracepoint_sinks[NR_TRACEPOINTS] = { 0 };
+
+static const char *tracepoint_names[NR_TRACEPOINTS] = {
+	[TP_TRANSLATE] = "translate",
+	[TP_PAGE_FAULT] = "fault",
+	[TP_ALLOC_PAGE] = "alloc",
+	[TP_FREE_PAGE] = "free",
+	[TP_SWITCH_PROCESS] = "switch",
+};
+
+static unsigned long nr_events[NR_TRACEPOINTS];
+static unsigned long histograms[NR_TRACEPOINTS][NR_TRACE_HISTOGRAM_BUCKETS];
+
+static struct trace_event {
+	unsigned long seq;
+	enum tracepoint tp;
+	long args[2];
+} ring[NR_TRACE_RING_EVENTS];
+static unsigned long ring_seq = 0;
+
+
+/**
+ * Bucket 0 holds 0, and bucket i holds [2^(i-1), 2^i)
+ */
+static unsigned int __histogram_bucket(unsigned long value)
+{
+	unsigned int bucket = 0;
+
+	while (value && bucket < NR_TRACE_HISTOGRAM_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+__attribute__((noinline, cold))
+void __fire_tracepoint(enum tracepoint tp, long arg0, long arg1)
+{
+	unsigned char sinks = tracepoint_sinks[tp];
+
+	if (sinks & TRACE_SINK_COUNTER) {
+		nr_events[tp]++;
+	}
+	if (sinks & TRACE_SINK_HISTOGRAM) {
+		histograms[tp][__histogram_bucket(arg0)]++;
+	}
+	if (sinks & TRACE_SINK_RING) {
+		struct trace_event *event = &ring[ring_seq % NR_TRACE_RING_EVENTS];
+
+		event->seq = ring_seq++;
+		event->tp = tp;
+		event->args[0] = arg0;
+		event->args[1] = arg1;
+	}
+}
+
+static bool __parse_sinks(char *sinks, unsigned char *mask)
+{
+	*mask = 0;
+
+	for (char *sink = strtok(sinks, ","); sink; sink = strtok(NULL, ",")) {
+		if (!strcasecmp(sink, "counter")) {
+			*mask |= TRACE_SINK_COUNTER;
+		} else if (!strcasecmp(sink, "histogram")) {
+			*mask |= TRACE_SINK_HISTOGRAM;
+		} else if (!strcasecmp(sink, "ring")) {
+			*mask |= TRACE_SINK_RING;
+		} else {
+			return false;
+		}
+	}
+	return *mask != 0;
+}
+
+bool enable_tracepoints(char *spec)
+{
+	char *sinks = strchr(spec, ':');
+	unsigned char mask = TRACE_SINK_COUNTER;
+	unsigned char enabled[NR_TRACEPOINTS] = { 0 };
+	char *saveptr;
+
+#ifndef CONFIG_TRACEPOINTS
+	fprintf(stderr, "Tracepoints are not compiled in\n");
+	return false;
+#endif
+
+	if (sinks) {
+		*sinks++ = '\0';
+		if (!__parse_sinks(sinks, &mask)) return false;
+	}
+
+	for (char *name = strtok_r(spec, ",", &saveptr); name;
+			name = strtok_r(NULL, ",", &saveptr)) {
+		bool found = false;
+
+		for (int tp = 0; tp < NR_TRACEPOINTS; tp++) {
+			if (!strcasecmp(name, "all") || !strcasecmp(name, tracepoint_names[tp])) {
+				enabled[tp] = true;
+				found = true;
+			}
+		}
+		if (!found) return false;
+	}
+
+	for (int tp = 0; tp < NR_TRACEPOINTS; tp++) {
+		if (enabled[tp]) tracepoint_sinks[tp] |= mask;
+	}
+	return true;
+}
+
+void show_tracepoints(void)
+{
+	unsigned char sinks = 0;
+
+	for (int tp = 0; tp < NR_TRACEPOINTS; tp++) {
+		sinks |= tracepoint_sinks[tp];
+	}
+	if (!sinks) return;
+
+	fprintf(stderr, "*** Tracepoints ***\n");
+
+	for (int tp = 0; tp < NR_TRACEPOINTS; tp++) {
+		if (!(tracepoint_sinks[tp] & TRACE_SINK_COUNTER)) continue;
+		fprintf(stderr, "%-9s: %lu events\n", tracepoint_names[tp], nr_events[tp]);
+	}
+
+	for (int tp = 0; tp < NR_TRACEPOINTS; tp++) {
+		if (!(tracepoint_sinks[tp] & TRACE_SINK_HISTOGRAM)) continue;
+
+		fprintf(stderr, "%s histogram:\n", tracepoint_names[tp]);
+		for (int i = 0; i < NR_TRACE_HISTOGRAM_BUCKETS; i++) {
+			if (!histograms[tp][i]) continue;
+			fprintf(stderr, "  [%10lu, %10lu) %lu\n",
+					i ? 1UL << (i - 1) : 0UL, 1UL << i, histograms[tp][i]);
+		}
+	}
+
+	if (sinks & TRACE_SINK_RING) {
+		unsigned long seq = ring_seq > NR_TRACE_RING_EVENTS ?
+				ring_seq - NR_TRACE_RING_EVENTS : 0;
+
+		fprintf(stderr, "last %lu of %lu events:\n", ring_seq - seq, ring_seq);
+		for (; seq < ring_seq; seq++) {
+			struct trace_event *event = &ring[seq % NR_TRACE_RING_EVENTS];
+
+			fprintf(stderr, "  %8lu %-9s %ld %ld\n", event->seq,
+					tracepoint_names[event->tp], event->args[0], event->args[1]);
+		}
+	}
+	fprintf(stderr, "\n");
+}
@@ -0,0 +1,97 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __TRACEPOINT_H__
+#define __TRACEPOINT_H__
+
+#include "types.h"
+
+/**
+ * Tracepoints in the hot paths of the simulator. A tracepoint fires an event
+ * with two arguments into the sinks enabled for it.
+ *
+ * The tracepoints are compiled in only if CONFIG_TRACEPOINTS is defined
+ * (build with "make TRACEPOINTS=0" to leave them out). When compiled in, a
+ * disabled tracepoint costs a load of its flag and a branch, which is laid
+ * out of the hot path and predicted not taken; the event is built in the
+ * out-of-line __fire_tracepoint() only when the tracepoint is enabled.
+ */
+enum tracepoint {
+	TP_TRANSLATE,		/* vpn, pfn (-1 if not translated) */
+	TP_PAGE_FAULT,		/* vpn, handled */
+	TP_ALLOC_PAGE,		/* vpn, pfn (-1 if the memory is full) */
+	TP_FREE_PAGE,		/* vpn, pfn */
+	TP_SWITCH_PROCESS,	/* pid switched to, pid switched from */
+	NR_TRACEPOINTS,
+};
+
+/**
+ * Sinks of the events
+ *
+ * - counter  : Count the events
+ * - histogram: Histogram of the first argument in power-of-two buckets
+ * - ring     : Keep the last NR_TRACE_RING_EVENTS events in a ring buffer
+ */
+#define TRACE_SINK_COUNTER	(1 << 0)
+#define TRACE_SINK_HISTOGRAM	(1 << 1)
+#define TRACE_SINK_RING		(1 << 2)
+
+#define NR_TRACE_HISTOGRAM_BUCKETS	33
+#define NR_TRACE_RING_EVENTS		64
+
+/* Sinks enabled for each tracepoint. Zero if the tracepoint is disabled */
+extern unsigned char tracepoint_sinks[NR_TRACEPOINTS];
+
+void __fire_tracepoint(enum tracepoint tp, long arg0, long arg1);
+
+#ifdef CONFIG_TRACEPOINTS
+#define trace_event(tp, arg0, arg1) \
+	do { \
+		if (__builtin_expect(tracepoint_sinks[tp], 0)) \
+			__fire_tracepoint(tp, arg0, arg1); \
+	} while (0)
+#else
+#define trace_event(tp, arg0, arg1) do { } while (0)
+#endif
+
+/* The PFNs are unsigned int, so -1 is taken back as int to be stored as -1 */
+#define trace_translate(vpn, pfn)	trace_event(TP_TRANSLATE, vpn, (int)(pfn))
+#define trace_page_fault(vpn, handled)	trace_event(TP_PAGE_FAULT, vpn, handled)
+#define trace_alloc_page(vpn, pfn)	trace_event(TP_ALLOC_PAGE, vpn, (int)(pfn))
+#define trace_free_page(vpn, pfn)	trace_event(TP_FREE_PAGE, vpn, pfn)
+#define trace_switch_process(to, from)	trace_event(TP_SWITCH_PROCESS, to, from)
+
+/***********************************************************************
+ * enable_tracepoints()
+ *
+ * DESCRIPTION
+ *  Enable the tracepoints in @spec, which is given as
+ *  "<tracepoint>[,<tracepoint>...][:<sink>[,<sink>...]]". The tracepoints
+ *  are translate, fault, alloc, free, switch, or all. The sinks are counter,
+ *  histogram, or ring, and the counter is used if no sink is given.
+ *
+ * RETURN VALUE
+ *  Return @true if @spec is valid
+ */
+bool enable_tracepoints(char *spec);
+
+/***********************************************************************
+ * show_tracepoints()
+ *
+ * DESCRIPTION
+ *  Report what the sinks of the enabled tracepoints have collected.
+ */
+void show_tracepoints(void);
+
+#endif
@@ -18,38 +18,46 @@
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
-#include <ctype.h>
 #include <inttypes.h>
 #include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "types.h"
-#include "parser.h"
 
 #include "list_head.h"
 #include "vm.h"
+#include "tlb.h"
+#include "prefetch.h"
+#include "cache.h"
+#include "arena.h"
+#include "trace.h"
+#include "vmz.h"
+#include "sample.h"
+#include "numa.h"
+#include "perf.h"
+#include "tracepoint.h"
+#include "engine.h"
 
 static bool verbose = true;
 
 /**
- * Initial process
+ * Currently running process. The initial process (pid 0) is created when the
+ * system boots.
  */
-static struct process init = {
-	.pid = 0,
-	.list = LIST_HEAD_INIT(init.list),
-	.pagetable = {
-		.outer_ptes = { NULL },
-	},
-};
+struct process *current = NULL;
 
 /**
- * Currently running process
+ * Ready queue
  */
-struct process *current = &init;
+LIST_HEAD(processes);
 
 /**
- * Ready queue
+ * Guests on the system, and the frames surrendered to the host by balloons
  */
-LIST_HEAD(processes);
+LIST_HEAD(guests);
+unsigned int nr_balloon_frames = 0;
 
 /**
  * Page table base register
@@ -57,16 +65,280 @@ LIST_HEAD(processes);
 struct pagetable *ptbr = NULL;
 
 /**
- * Map count for each page frame
+ * Descriptors of the page frames, and the number of page frames in the system
+ */
+struct page *mem_map = NULL;
+unsigned int nr_pageframes = 0;
+
+/**
+ * Map counts overflowing @_mapcount of the frame descriptors, hashed by pfn
+ */
+struct mapcount_overflow {
+	unsigned int pfn;
+	unsigned int count;
+	struct mapcount_overflow *next;
+};
+static struct mapcount_overflow *mapcount_overflows[NR_MAPCOUNT_BUCKETS];
+
+unsigned int __overflow_mapcount(unsigned int pfn)
+{
+	struct mapcount_overflow *entry = mapcount_overflows[pfn % NR_MAPCOUNT_BUCKETS];
+
+	for (; entry; entry = entry->next) {
+		if (entry->pfn == pfn) return entry->count;
+	}
+	assert(!"Overflowed map count is missing");
+	return MAPCOUNT_OVERFLOW;
+}
+
+/**
+ * Set the map count of @pfn that overflows or has overflowed. The entry is
+ * removed once the count fits in the descriptor again.
+ */
+void __set_overflow_mapcount(unsigned int pfn, unsigned int count)
+{
+	struct mapcount_overflow **pos = &mapcount_overflows[pfn % NR_MAPCOUNT_BUCKETS];
+	struct mapcount_overflow *entry;
+
+	for (; (entry = *pos); pos = &entry->next) {
+		if (entry->pfn == pfn) break;
+	}
+
+	if (count < MAPCOUNT_OVERFLOW) {
+		if (entry) {
+			*pos = entry->next;
+			arena_free(entry);
+		}
+		mem_map[pfn]._mapcount = count;
+		return;
+	}
+
+	if (!entry) {
+		entry = arena_malloc(sizeof(*entry));
+		if (!entry) {
+			fprintf(stderr, "Unable to keep the map count of %u\n", pfn);
+			abort();
+		}
+		entry->pfn = pfn;
+		entry->next = NULL;
+		*pos = entry;
+	}
+	entry->count = count;
+	mem_map[pfn]._mapcount = MAPCOUNT_OVERFLOW;
+}
+
+/**
+ * Page size is (1 << @page_shift) bytes
+ */
+static unsigned int page_shift = DEFAULT_PAGE_SHIFT;
+
+/**
+ * Statistics of the memory accesses. Each access references the cache line
+ * at its physical address, which is composed of the pfn and the page offset.
+ */
+static unsigned long nr_accesses = 0;
+static unsigned long nr_page_faults = 0;
+static unsigned long nr_first_touches = 0;
+static unsigned long nr_rejected_accesses = 0;	/* Beyond the address space */
+static unsigned long nr_unbacked_accesses = 0;	/* No frame on the first touch */
+unsigned long nr_copied_pages = 0;
+static struct cache_stats data_cache_stats;
+
+/**
+ * The simulation is a run of the page-size sweep. The line of each access is
+ * left out, and the rejected accesses are summarized at the end.
+ */
+static bool sweeping = false;
+
+/**
+ * Page coloring policy of the page frame allocator
+ */
+enum page_coloring page_coloring = COLORING_NONE;
+unsigned long nr_color_fallbacks = 0;
+
+/**
+ * Overcommit policy and the commit charge
+ */
+enum overcommit_policy overcommit_policy = OVERCOMMIT_HEURISTIC;
+unsigned long nr_committed_pages = 0;
+unsigned long nr_commit_refusals = 0;
+
+/**
+ * TLB of the MMU, which coalesces contiguous PTE runs into a single entry,
+ * and the baseline TLB that is looked up in parallel to see how much the
+ * coalescing improves the hit rate.
+ */
+static struct tlb tlb = {
+	.coalesce = true,
+};
+static struct tlb tlb_baseline = {
+	.coalesce = false,
+};
+
+/**
+ * The number of TLB misses that are resolved by the range translations
+ * without walking the page table.
  */
-unsigned int mapcounts[NR_PAGEFRAMES] = { 0 };
+static unsigned long nr_range_hits = 0;
+
+/**
+ * Cost model of the address translation. Each step of the page walk reads
+ * the page table entry through the host cache hierarchy.
+ */
+static unsigned long nr_translations = 0;
+static unsigned long translation_cycles = 0;
+static struct cache_stats walk_cache_stats;
+
+/**
+ * Host pages backing the simulator's own structures (the frame metadata, the
+ * page directories, and so on). They are allocated by the standard allocator,
+ * or from an anonymous arena on the base pages or the huge pages of the host.
+ * The time the simulation starts at tells the throughput of the simulator.
+ */
+enum host_pages {
+	HOST_PAGES_LIBC,
+	HOST_PAGES_BASE,
+	HOST_PAGES_HUGE,
+};
+static enum host_pages host_pages = HOST_PAGES_LIBC;
+static struct timespec simulation_start;
 
 
 extern unsigned int alloc_page(unsigned int vpn, unsigned int rw);
 extern void free_page(unsigned int vpn);
 extern bool handle_page_fault(unsigned int vpn, unsigned int rw);
 extern void switch_process(unsigned int pid);
+extern unsigned int inflate_balloon(struct guest *guest, unsigned int nr_pages);
+extern unsigned int deflate_balloon(struct guest *guest, unsigned int nr_pages);
+extern bool add_memory(unsigned int nr_frames);
+extern unsigned int remove_memory(unsigned int start, unsigned int nr_frames,
+		unsigned int *nr_migrated, unsigned int *nr_evicted);
+extern void persist_memory_state(void);
+
+
+/**
+ * __walk_pagetable()
+ *
+ * DESCRIPTION
+ *   Walk through the page table pointed by @ptbr to find the PTE for @vpn.
+ *
+ * RETURN
+ *   The PTE if @vpn is accessible for @rw
+ *   NULL otherwise
+ */
+static struct pte *__walk_pagetable(unsigned int rw, unsigned int vpn)
+{
+	int pd_index = vpn / NR_PTES_PER_PAGE;
+	int pte_index = vpn % NR_PTES_PER_PAGE;
+
+	struct pagetable *pt = ptbr;
+	struct pte_directory *pd;
+	struct pte *pte;
+
+	/* Page table is invalid, or @vpn is beyond it */
+	if (!pt || vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) return NULL;
+
+	pd = pt->outer_ptes[pd_index];
+
+	/* Page directory does not exist */
+	if (!pd) return NULL;
+
+	pte = &pd->ptes[pte_index];
+
+	/* PTE is invalid */
+	if (!pte->valid) return NULL;
+
+	/* Unable to handle the write access */
+	if (rw == RW_WRITE) {
+		if (!pte->writable) return NULL;
+	}
+
+	return pte;
+}
+
+static bool __prefetch_walk(unsigned int vpn, unsigned int *pfn)
+{
+	struct pte *pte = __walk_pagetable(RW_READ, vpn);
+
+	if (!pte) return false;
+
+	*pfn = pte->pfn;
+	return true;
+}
+
+/**
+ * __pagetable_pfn()
+ *
+ * DESCRIPTION
+ *   Page-table pages are not allocated from the page frames, so they are
+ *   placed above any page frame in the simulated physical address space.
+ *   Each process gets the outer page table followed by a page directory for
+ *   every outer PTE.
+ *
+ * RETURN
+ *   The page frame of the page directory at @pd_index in the page table of
+ *   @pid, or the frame of the outer page table if @pd_index is -1
+ */
+#define PAGETABLE_PFN_BASE	(1UL << 24)
+#define PTE_SIZE		8
 
+static unsigned long __pagetable_pfn(unsigned int pid, int pd_index)
+{
+	return PAGETABLE_PFN_BASE +
+			(unsigned long)pid * (NR_PTES_PER_PAGE + 1) + (pd_index + 1);
+}
+
+/**
+ * __charge_walk()
+ *
+ * DESCRIPTION
+ *   Charge the cost of walking the page table for @vpn. Each step reads the
+ *   entry in the outer page table and the PTE in the page directory at their
+ *   simulated physical addresses.
+ */
+static void __charge_walk(unsigned int vpn)
+{
+	unsigned long pt_pfn;
+
+	if (!ptbr) return;
+
+	pt_pfn = __pagetable_pfn(current->pid, -1);
+	translation_cycles += access_cache(
+			(pt_pfn << page_shift) + (vpn / NR_PTES_PER_PAGE) * PTE_SIZE,
+			&walk_cache_stats);
+
+	if (!ptbr->outer_ptes[vpn / NR_PTES_PER_PAGE]) return;
+
+	pt_pfn = __pagetable_pfn(current->pid, vpn / NR_PTES_PER_PAGE);
+	translation_cycles += access_cache(
+			(pt_pfn << page_shift) + (vpn % NR_PTES_PER_PAGE) * PTE_SIZE,
+			&walk_cache_stats);
+}
+
+/**
+ * __lookup_range()
+ *
+ * DESCRIPTION
+ *   Look up the range translations in the page table pointed by @ptbr.
+ *
+ * RETURN
+ *   The range translation covering @vpn for @rw
+ *   NULL otherwise
+ */
+static struct range_translation *__lookup_range(unsigned int rw, unsigned int vpn)
+{
+	if (!ptbr) return NULL;
+
+	for (int i = 0; i < NR_RANGE_TRANSLATIONS; i++) {
+		struct range_translation *r = &ptbr->ranges[i];
+
+		if (!r->valid || vpn < r->base || vpn >= r->limit) continue;
+		if (rw == RW_WRITE && !r->writable) return NULL;
+
+		return r;
+	}
+	return NULL;
+}
 
 /**
  * __translate()
@@ -74,6 +346,10 @@ extern void switch_process(unsigned int pid);
  * DESCRIPTION
  *   This function simulates the address translation in the processor.
  *   It translates @vpn to @pfn using the page table pointed by @ptbr.
+ *   The TLB is looked up first. On miss, the range translations are checked
+ *   before walking the page table, and the TLB is filled with the result.
+ *   The contiguous PTE run is filled as a single coalesced entry when the
+ *   PTE has the contiguous hint.
  *
  * RETURN
  *   @true on successful translation
@@ -82,154 +358,815 @@ extern void switch_process(unsigned int pid);
  */
 static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn)
 {
-	int pd_index = vpn / NR_PTES_PER_PAGE;
-	int pte_index = vpn % NR_PTES_PER_PAGE;
-
-	struct pagetable *pt = ptbr;
-	struct pte_directory *pd;
+	unsigned int base_vpn = vpn;
+	unsigned int nr_pages = 1;
+	unsigned int __pfn;
+	struct range_translation *range;
 	struct pte *pte;
 
-	/***
-	 * Advanced tasks: Implement TLB hook here
+	/* The baseline TLB is maintained just to keep its statistics */
+	if (!lookup_tlb(&tlb_baseline, rw, vpn, &__pfn)) {
+		pte = __walk_pagetable(rw, vpn);
+		if (pte) fill_tlb(&tlb_baseline, vpn, vpn, pte->pfn, 1, pte->writable);
+	}
+
+	nr_translations++;
+	translation_cycles += TLB_CYCLES;
+
+	if (lookup_tlb(&tlb, rw, vpn, pfn)) return true;
+
+	prefetch_on_miss(vpn, __prefetch_walk);
+
+	translation_cycles += RANGE_CYCLES;
+	range = __lookup_range(rw, vpn);
+	if (range) {
+		nr_range_hits++;
+		*pfn = vpn + range->offset;
+
+		/* The range can be filled as a coalesced entry if it covers the group */
+		base_vpn = vpn & ~(NR_CONTIG_PTES - 1);
+		if (base_vpn >= range->base && base_vpn + NR_CONTIG_PTES <= range->limit &&
+				(base_vpn + range->offset) % NR_CONTIG_PTES == 0) {
+			nr_pages = NR_CONTIG_PTES;
+		} else {
+			base_vpn = vpn;
+		}
+		fill_tlb(&tlb, vpn, base_vpn, base_vpn + range->offset, nr_pages,
+				range->writable);
+		return true;
+	}
+
+	__charge_walk(vpn);
+
+	pte = __walk_pagetable(rw, vpn);
+	if (!pte) return false;
+
+	if (pte->contig) {
+		base_vpn = vpn & ~(NR_CONTIG_PTES - 1);
+		nr_pages = NR_CONTIG_PTES;
+	}
+	fill_tlb(&tlb, vpn, base_vpn, pte->pfn - (vpn - base_vpn), nr_pages,
+			pte->writable);
+
+	*pfn = pte->pfn;
+
+	return true;
+}
+
+static void __invalidate_tlb(unsigned int vpn)
+{
+	invalidate_tlb(&tlb, vpn);
+	invalidate_tlb(&tlb_baseline, vpn);
+	invalidate_prefetch(vpn);
+}
+
+static void __flush_tlb(void)
+{
+	flush_tlb(&tlb);
+	flush_tlb(&tlb_baseline);
+	flush_prefetch();
+}
+
+/**
+ * __count_fault()
+ *
+ * DESCRIPTION
+ *   Charge the page fault at @vpn to the current process by how it is
+ *   resolved. @handled and @copied tell whether the fault handler resolved
+ *   the fault and whether it copied the page to do so.
+ */
+static void __count_fault(unsigned int vpn, bool handled, bool copied)
+{
+	struct process_stats *stats = &current->stats;
+	enum fault_type type;
+
+	if (handled) {
+		type = copied ? FAULT_COW : FAULT_REUSE;
+	} else {
+		type = __walk_pagetable(RW_READ, vpn) ? FAULT_PROTECTION : FAULT_INVALID;
+	}
+	stats->nr_faults[type]++;
+	stats->region_faults[vpn / NR_PTES_PER_PAGE]++;
+}
+
+/**
+ * __fast_forward()
+ *
+ * DESCRIPTION
+ *   Access @vpn without the TLBs and the caches. Only the page faults are
+ *   handled to keep the page tables the same as the detailed simulation.
+ */
+static bool __fast_forward(unsigned int vpn, unsigned int rw)
+{
+	for (int nr_retries = 0; nr_retries < 2; nr_retries++) {
+		if (__walk_pagetable(rw, vpn)) return true;
+
+		if (!handle_page_fault(vpn, rw)) break;
+		__invalidate_tlb(vpn);
+	}
+
+	fprintf(stderr, "Unable to access %u\n", vpn);
+	return false;
+}
+
+/**
+ * __access_memory
+ *
+ * DESCRIPTION
+ *   Simulate the MMU in the processor and call page fault handler
+ *   if necessary.
+ *
+ * RETURN
+ *   @true on successful access
+ *   @false if unable to access @vpn for @rw
+ */
+static bool __access_memory(unsigned int vpn, unsigned int offset, unsigned int rw)
+{
+	unsigned int pfn;
+	int ret;
+	int nr_retries = 0;
+	enum sample_phase phase = SAMPLE_DETAIL;
+	unsigned long nr_faults = nr_page_faults;
+	unsigned long nr_tlb_misses = tlb.nr_misses;
+	unsigned long cycles = translation_cycles;
+	unsigned long nr_copies;
+	struct perf_sample sample;
+	bool translated;
+
+	/* Cannot read and write at the same time!! */
+	assert((rw & RW_READ) ^ (rw & RW_WRITE));
+
+	/**
+	 * We have NR_PTES_PER_PAGE entries in the outer table and so do for
+	 * inner page table. Thus each process can have up to NR_PTES_PER_PAGE^2
+	 * as its VPN
 	 */
+	if (vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) {
+		nr_rejected_accesses++;
+		if (!sweeping) fprintf(stderr, "Unable to access %u\n", vpn);
+		return false;
+	}
 
-	/* Page table is invalid */
-	if (!pt) return false;
+	if (sampling_mode != SAMPLING_NONE) {
+		phase = sample_access(vpn);
+		if (phase == SAMPLE_SKIP) return __fast_forward(vpn, rw);
+	}
 
-	pd = pt->outer_ptes[pd_index];
+	nr_accesses++;
+	current->stats.nr_accesses++;
+	current->stats.region_accesses[vpn / NR_PTES_PER_PAGE]++;
 
-	/* Page directory does not exist */
-	if (!pd) return false;
+	do {
+		/* Ask MMU to translate VPN */
+		perf_begin(PERF_TRANSLATE, &sample);
+		translated = __translate(rw, vpn, &pfn);
+		perf_end(PERF_TRANSLATE, &sample);
+		trace_translate(vpn, translated ? pfn : -1);
+
+		if (translated) {
+			/* Success on address translation */
+			if (!sweeping) fprintf(stderr, "%3u --> %-3u\n", vpn, pfn);
+			cycles = translation_cycles - cycles +
+				access_cache(((unsigned long)pfn << page_shift) + offset,
+						&data_cache_stats);
+
+			if (sampling_mode != SAMPLING_NONE && phase == SAMPLE_DETAIL) {
+				record_sample(nr_page_faults - nr_faults,
+						tlb.nr_misses - nr_tlb_misses, cycles);
+			}
+			return true;
+		}
+
+		/**
+		 * Failed to translate the address. So, call OS through the page fault
+		 * and restart the translation if the fault is successfully handled.
+		 * Count the number of retries to prevent buggy translation.
+		 */
+		nr_retries++;
+		nr_page_faults++;
+		nr_copies = nr_copied_pages;
+		perf_begin(PERF_FAULT, &sample);
+		ret = handle_page_fault(vpn, rw);
+		perf_end(PERF_FAULT, &sample);
+		trace_page_fault(vpn, ret);
+		__count_fault(vpn, ret, nr_copied_pages != nr_copies);
+
+		/* The fault handler may have changed the PTE for @vpn */
+		__invalidate_tlb(vpn);
+	} while (ret == true && nr_retries < 2);
+
+	if (ret == false) {
+		fprintf(stderr, "Unable to access %u\n", vpn);
+	}
+
+	if (sampling_mode != SAMPLING_NONE && phase == SAMPLE_DETAIL) {
+		record_sample(nr_page_faults - nr_faults,
+				tlb.nr_misses - nr_tlb_misses, translation_cycles - cycles);
+	}
+	return ret;
+}
+
+static unsigned long __commit_limit(void)
+{
+	return (unsigned long)nr_pageframes * OVERCOMMIT_RATIO / 100;
+}
+
+static void __report_commit_refusal(void)
+{
+	fprintf(stderr, "commit limit exceeded (committed %lu pages, limit %lu pages)\n",
+			nr_committed_pages, __commit_limit());
+}
+
+/**
+ * __access_address
+ *
+ * DESCRIPTION
+ *   Access the byte address @addr for @rw. The address is split into the VPN
+ *   and the page offset according to the page size. The page is allocated
+ *   for read and write on the first touch, as an anonymous memory does.
+ *
+ * RETURN
+ *   @true on successful access
+ *   @false if unable to access @addr for @rw
+ */
+static bool __access_address(unsigned long addr, unsigned int rw)
+{
+	unsigned long vpn = addr >> page_shift;
+
+	if (vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) {
+		nr_rejected_accesses++;
+		if (!sweeping) fprintf(stderr, "Unable to access %#lx\n", addr);
+		return false;
+	}
+
+	if (!__walk_pagetable(RW_READ, vpn)) {
+		unsigned long nr_refusals = nr_commit_refusals;
+		unsigned int pfn = alloc_page(vpn, RW_READ | RW_WRITE);
+
+		trace_alloc_page(vpn, pfn);
+		if (pfn == -1) {
+			nr_unbacked_accesses++;
+			if (sweeping) return false;
+
+			if (nr_commit_refusals != nr_refusals) {
+				__report_commit_refusal();
+			} else {
+				fprintf(stderr, "memory is full\n");
+			}
+			return false;
+		}
+		nr_first_touches++;
+		current->stats.nr_first_touches++;
+	}
+
+	return __access_memory(vpn, addr & ((1UL << page_shift) - 1), rw);
+}
+
+/**
+ * __alloc_page()
+ *
+ * DESCRIPTION
+ *   Allocate a page frame for @vpn. A request refused by the overcommit
+ *   policy fails the allocation only, as mmap() fails with ENOMEM, whereas
+ *   running out of the page frames ends the simulation.
+ *
+ * RETURN
+ *   @false if the simulation cannot go on
+ */
+static bool __alloc_page(unsigned int vpn, unsigned int rw)
+{
+	unsigned long nr_refusals = nr_commit_refusals;
+	unsigned int pfn;
+	struct pte *pte;
+
+	assert(rw);
+
+	if (vpn >= NR_PTES_PER_PAGE * NR_PTES_PER_PAGE) {
+		fprintf(stderr, "Unable to allocate %u beyond the page table\n", vpn);
+		return true;
+	}
+
+	pte = __walk_pagetable(RW_READ, vpn);
+	if (pte) {
+		fprintf(stderr, "%u is already allocated to %u\n", vpn, pte->pfn);
+		return false;
+	}
+
+	pfn = alloc_page(vpn, rw);
+	trace_alloc_page(vpn, pfn);
+	if (pfn == -1 && nr_commit_refusals != nr_refusals) {
+		__report_commit_refusal();
+		return true;
+	}
+	if (pfn == -1) {
+		fprintf(stderr, "memory is full\n");
+		return false;
+	}
+	fprintf(stderr, "alloc %3u --> %-3u\n", vpn, pfn);
+	
+	return true;
+}
+
+static void __add_memory(unsigned int nr_frames)
+{
+	if (!add_memory(nr_frames)) {
+		fprintf(stderr, "Unable to add %u frames\n", nr_frames);
+		return;
+	}
+	fprintf(stderr, "memadd %u frames, %u frames in total\n",
+			nr_frames, nr_pageframes);
+}
+
+static void __remove_memory(unsigned int start, unsigned int nr_frames)
+{
+	unsigned int nr_migrated, nr_evicted;
+	unsigned int nr_removed;
+
+	nr_removed = remove_memory(start, nr_frames, &nr_migrated, &nr_evicted);
+
+	/* PTEs of any process may have been changed */
+	__flush_tlb();
+
+	fprintf(stderr, "memremove %u frames (%u migrated, %u evicted), "
+			"%u frames in total\n",
+			nr_removed, nr_migrated, nr_evicted, nr_pageframes);
+}
+
+static struct guest *__find_guest(unsigned int id)
+{
+	struct guest *guest;
+
+	list_for_each_entry(guest, &guests, list) {
+		if (guest->id == id) return guest;
+	}
+	return NULL;
+}
+
+/**
+ * __set_guest()
+ *
+ * DESCRIPTION
+ *   Make @current belong to the guest @id that has @nr_frames page frames.
+ *   Create the guest if it does not exist. The frames the process already
+ *   uses remain charged to their original guests.
+ */
+static void __set_guest(unsigned int id, unsigned int nr_frames)
+{
+	struct guest *guest = __find_guest(id);
+
+	if (!guest) {
+		guest = arena_calloc(1, sizeof(*guest));
+		guest->id = id;
+		list_add_tail(&guest->list, &guests);
+	}
+	guest->nr_frames = nr_frames;
+	current->guest = guest;
+
+	fprintf(stderr, "pid %u joins guest %u with %u frames\n",
+			current->pid, id, nr_frames);
+}
+
+static void __inflate_balloon(unsigned int id, unsigned int nr_pages)
+{
+	struct guest *guest = __find_guest(id);
+	unsigned int nr_reclaimed;
+
+	if (!guest) {
+		fprintf(stderr, "No guest %u\n", id);
+		return;
+	}
+
+	nr_reclaimed = inflate_balloon(guest, nr_pages);
+	if (nr_reclaimed) __flush_tlb();
+
+	fprintf(stderr, "inflate guest %u by %u pages, %u pages reclaimed\n",
+			id, nr_pages, nr_reclaimed);
+}
+
+static void __deflate_balloon(unsigned int id, unsigned int nr_pages)
+{
+	struct guest *guest = __find_guest(id);
+
+	if (!guest) {
+		fprintf(stderr, "No guest %u\n", id);
+		return;
+	}
+
+	fprintf(stderr, "deflate guest %u by %u pages\n",
+			id, deflate_balloon(guest, nr_pages));
+}
+
+static int __guest_free_frames(struct guest *guest)
+{
+	return (int)guest->nr_frames - guest->balloon - (int)guest->nr_used;
+}
+
+/**
+ * __balance_guests()
+ *
+ * DESCRIPTION
+ *   The balloon policy driven by the free memory targets. Each guest wants
+ *   to keep BALLOON_FREE_TARGET percent of its frames free. The guests short
+ *   of the target deflate their balloons, and the guests having more free
+ *   frames than the target inflate theirs by the surplus to provide the
+ *   frames to them.
+ */
+static void __balance_guests(void)
+{
+	struct guest *guest;
+	unsigned int nr_wanted = 0;
+	unsigned int nr_inflated = 0, nr_reclaimed = 0, nr_deflated = 0;
+
+	list_for_each_entry(guest, &guests, list) {
+		int target = guest->nr_frames * BALLOON_FREE_TARGET / 100;
+		int free = __guest_free_frames(guest);
+
+		if (free < target) nr_wanted += target - free;
+	}
+
+	list_for_each_entry(guest, &guests, list) {
+		int target = guest->nr_frames * BALLOON_FREE_TARGET / 100;
+		int surplus = __guest_free_frames(guest) - target;
+		unsigned int nr_pages;
+
+		if (nr_balloon_frames >= nr_wanted) break;
+		if (surplus <= 0) continue;
+
+		nr_pages = nr_wanted - nr_balloon_frames;
+		if (nr_pages > surplus) nr_pages = surplus;
+
+		nr_reclaimed += inflate_balloon(guest, nr_pages);
+		nr_inflated += nr_pages;
+	}
+
+	list_for_each_entry(guest, &guests, list) {
+		int target = guest->nr_frames * BALLOON_FREE_TARGET / 100;
+		int free = __guest_free_frames(guest);
+
+		if (free >= target) continue;
+		nr_deflated += deflate_balloon(guest, target - free);
+	}
+
+	if (nr_reclaimed) __flush_tlb();
+
+	fprintf(stderr, "balloon inflated %u pages (%u reclaimed), deflated %u pages\n",
+			nr_inflated, nr_reclaimed, nr_deflated);
+}
+
+static void __show_guests(void)
+{
+	struct guest *guest;
+
+	fprintf(stderr, "guest   frames  balloon     used reclaimed   gained\n");
+	list_for_each_entry(guest, &guests, list) {
+		fprintf(stderr, "%5u %8u %8d %8u %9lu %8lu\n", guest->id,
+				guest->nr_frames, guest->balloon, guest->nr_used,
+				guest->nr_reclaimed, guest->nr_gained);
+	}
+	fprintf(stderr, "%u frames surrendered to the host\n\n", nr_balloon_frames);
+}
+
+static struct process *__find_process(unsigned int pid)
+{
+	struct process *process;
+
+	list_for_each_entry(process, &processes, list) {
+		if (process->pid == pid) return process;
+	}
+	return NULL;
+}
+
+/**
+ * Count the frames mapped by @process, those of them shared with the other
+ * processes, and the page directories of @process
+ */
+static void __count_mappings(struct process *process, unsigned int *nr_frames,
+		unsigned int *nr_shared, unsigned int *nr_directories)
+{
+	*nr_frames = *nr_shared = *nr_directories = 0;
+
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte_directory *pd = process->pagetable.outer_ptes[i];
+
+		if (!pd) continue;
+		(*nr_directories)++;
+
+		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			if (!pd->ptes[j].valid) continue;
+			(*nr_frames)++;
+			if (page_mapcount(pd->ptes[j].pfn) > 1) (*nr_shared)++;
+		}
+	}
+}
+
+static void __show_process_stats(unsigned int pid)
+{
+	struct process *process = __find_process(pid);
+	struct process_stats *stats;
+	unsigned int nr_frames, nr_shared, nr_directories;
+	unsigned long nr_faults = 0;
+
+	if (!process) {
+		fprintf(stderr, "No process %u\n", pid);
+		return;
+	}
+	stats = &process->stats;
+
+	for (int i = 0; i < NR_FAULT_TYPES; i++) {
+		nr_faults += stats->nr_faults[i];
+	}
+	__count_mappings(process, &nr_frames, &nr_shared, &nr_directories);
+
+	fprintf(stderr, "*** Statistics of PID %u ***\n", pid);
+	fprintf(stderr, "accesses : %lu, first touches %lu\n",
+			stats->nr_accesses, stats->nr_first_touches);
+	fprintf(stderr, "faults   : %lu (cow %lu, reuse %lu, protection %lu, invalid %lu)\n",
+			nr_faults, stats->nr_faults[FAULT_COW], stats->nr_faults[FAULT_REUSE],
+			stats->nr_faults[FAULT_PROTECTION], stats->nr_faults[FAULT_INVALID]);
+	fprintf(stderr, "copies   : %lu pages for copy-on-write\n",
+			stats->nr_faults[FAULT_COW]);
+	fprintf(stderr, "frames   : %u mapped, %u shared, %u page directories\n",
+			nr_frames, nr_shared, nr_directories);
+
+	fprintf(stderr, "%-7s %11s %8s\n", "region", "accesses", "faults");
+	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (!stats->region_accesses[i] && !stats->region_faults[i]) continue;
+		fprintf(stderr, "%3u-%-3u %11lu %8lu\n", i * NR_PTES_PER_PAGE,
+				(i + 1) * NR_PTES_PER_PAGE - 1,
+				stats->region_accesses[i], stats->region_faults[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+/**
+ * Path to export the statistics of the processes to at the end of simulation
+ */
+static const char *export_path = NULL;
+
+/**
+ * __export_process_stats()
+ *
+ * DESCRIPTION
+ *   Write the statistics of all processes to @path in CSV in the order they
+ *   are created. Each process has a row for the whole process (region "all")
+ *   followed by the rows for its regions with any access or fault, which
+ *   leave the per-process columns empty.
+ */
+static bool __export_process_stats(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	struct process *process;
+
+	if (!file) {
+		perror("fopen");
+		return false;
+	}
+
+	fprintf(file, "pid,region,accesses,faults,first_touches,cow,reuse,protection,"
+			"invalid,frames,shared,directories\n");
+
+	list_for_each_entry(process, &processes, list) {
+		struct process_stats *stats = &process->stats;
+		unsigned int pid = process->pid;
+		unsigned int nr_frames, nr_shared, nr_directories;
+		unsigned long nr_faults = 0;
+
+		for (int i = 0; i < NR_FAULT_TYPES; i++) {
+			nr_faults += stats->nr_faults[i];
+		}
+		__count_mappings(process, &nr_frames, &nr_shared, &nr_directories);
+
+		fprintf(file, "%u,all,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%u,%u,%u\n",
+				pid, stats->nr_accesses, nr_faults, stats->nr_first_touches,
+				stats->nr_faults[FAULT_COW], stats->nr_faults[FAULT_REUSE],
+				stats->nr_faults[FAULT_PROTECTION], stats->nr_faults[FAULT_INVALID],
+				nr_frames, nr_shared, nr_directories);
+
+		for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
+			if (!stats->region_accesses[i] && !stats->region_faults[i]) continue;
+			fprintf(file, "%u,%u-%u,%lu,%lu,,,,,,,,\n", pid,
+					i * NR_PTES_PER_PAGE, (i + 1) * NR_PTES_PER_PAGE - 1,
+					stats->region_accesses[i], stats->region_faults[i]);
+		}
+	}
 
-	pte = &pd->ptes[pte_index];
+	return fclose(file) == 0;
+}
 
-	/* PTE is invalid */
-	if (!pte->valid) return false;
+static bool __free_page(unsigned int vpn)
+{
+	struct pte *pte = __walk_pagetable(RW_READ, vpn);
 
-	/* Unable to handle the write access */
-	if (rw == RW_WRITE) {
-		if (!pte->writable) return false;
+	if (!pte) {
+		fprintf(stderr, "%u is not allocated\n", vpn);
+		return false;
 	}
-	*pfn = pte->pfn;
+	fprintf(stderr, "free %u (pfn %u)\n", vpn, pte->pfn);
+	trace_free_page(vpn, pte->pfn);
+	free_page(vpn);
+	__invalidate_tlb(vpn);
 
 	return true;
 }
 
 /**
- * __access_memory
+ * Path to the arena file to persist the simulator state in
+ */
+static const char *arena_path = NULL;
+static unsigned long state_version = STATE_VERSION;
+
+/**
+ * __persist_system()
  *
  * DESCRIPTION
- *   Simulate the MMU in the processor and call page fault handler
- *   if necessary.
- *
- * RETURN
- *   @true on successful access
- *   @false if unable to access @vpn for @rw
+ *   Make the system state persist in the arena. The state of the memory
+ *   microarchitecture (TLBs, prefetchers, and caches) and the statistics
+ *   start over at every run.
  */
-static bool __access_memory(unsigned int vpn, unsigned int rw)
+static void __persist_system(void)
 {
-	unsigned int pfn;
-	int ret;
-	int nr_retries = 0;
-
-	/* Cannot read and write at the same time!! */
-	assert((rw & RW_READ) ^ (rw & RW_WRITE));
-
-	/**
-	 * We have NR_PTES_PER_PAGE entries in the outer table and so do for
-	 * inner page table. Thus each process can have up to NR_PTES_PER_PAGE^2
-	 * as its VPN
-	 */
-	assert(vpn < NR_PTES_PER_PAGE * NR_PTES_PER_PAGE);
-
-	do {
-		/* Ask MMU to translate VPN */
-		if (__translate(rw, vpn, &pfn)) {
-			/* Success on address translation */
-			fprintf(stderr, "%3u --> %-3u\n", vpn, pfn);
-			return true;
-		}
-
-		/**
-		 * Failed to translate the address. So, call OS through the page fault
-		 * and restart the translation if the fault is successfully handled.
-		 * Count the number of retries to prevent buggy translation.
-		 */
-		nr_retries++;
-	} while ((ret = handle_page_fault(vpn, rw)) == true && nr_retries < 2);
-
-	if (ret == false) {
-		fprintf(stderr, "Unable to access %u\n", vpn);
+	arena_persist(&state_version, sizeof(state_version));
+	if (state_version != STATE_VERSION) {
+		fprintf(stderr, "Arena %s holds the state of version %lu, not %d\n",
+				arena_path, state_version, STATE_VERSION);
+		exit(EXIT_FAILURE);
 	}
 
-	return ret;
+	arena_persist(&current, sizeof(current));
+	arena_persist(&ptbr, sizeof(ptbr));
+	arena_persist_list(&processes);
+	arena_persist_list(&guests);
+	arena_persist(&nr_balloon_frames, sizeof(nr_balloon_frames));
+	arena_persist(&mem_map, sizeof(mem_map));
+	arena_persist(mapcount_overflows, sizeof(mapcount_overflows));
+	arena_persist(&nr_pageframes, sizeof(nr_pageframes));
+	arena_persist(&nr_committed_pages, sizeof(nr_committed_pages));
+
+	persist_memory_state();
 }
 
-static unsigned int __make_rwflag(const char *rw)
+static void __init_system(void)
 {
-	int len = strlen(rw);
-	unsigned int rwflag = 0;
+	struct process *init;
+
+	if (host_pages != HOST_PAGES_LIBC &&
+			!open_anon_arena(host_pages == HOST_PAGES_HUGE)) {
+		fprintf(stderr, "Unable to map the simulator state, use the standard allocator\n");
+		host_pages = HOST_PAGES_LIBC;
+	}
 
-	for (int i = 0; i < len; i++) {
-		if (rw[i] == 'r' || rw[i] == 'R') {
-			rwflag |= RW_READ;
+	if (arena_path) {
+		if (!open_arena(arena_path)) {
+			fprintf(stderr, "Unable to open arena %s\n", arena_path);
+			exit(EXIT_FAILURE);
 		}
-		if (rw[i] == 'w' || rw[i] == 'W') {
-			rwflag |= RW_WRITE;
+		__persist_system();
+
+		if (arena_restored()) {
+			fprintf(stderr, "Resume pid %u with %u page frames from %s\n",
+					current->pid, nr_pageframes, arena_path);
+			return;
 		}
 	}
-	return rwflag;
-}
 
-static bool __alloc_page(unsigned int vpn, unsigned int rw)
-{
-	unsigned int pfn;
+	init = arena_calloc(1, sizeof(*init));
+	if (!init) {
+		fprintf(stderr, "Unable to create the initial process\n");
+		exit(EXIT_FAILURE);
+	}
+	init->pid = 0;
+	INIT_LIST_HEAD(&init->list);
 
-	assert(rw);
+	current = init;
+	ptbr = &init->pagetable;
 
-	if (__translate(RW_READ, vpn, &pfn)) {
-		fprintf(stderr, "%u is already allocated to %u\n", vpn, pfn);
-		return false;
+	if (!add_memory(NR_PAGEFRAMES)) {
+		fprintf(stderr, "Unable to initialize page frames\n");
+		exit(EXIT_FAILURE);
 	}
 
-	pfn = alloc_page(vpn, rw);
-	if (pfn == -1) {
-		fprintf(stderr, "memory is full\n");
-		return false;
+	list_add_tail(&init->list, &processes);
+}
+
+static void __show_pageframes(void)
+{
+	for (unsigned int i = 0; i < nr_pageframes; i++) {
+		if (!page_mapcount(i)) continue;
+		fprintf(stderr, "%3u: %d\n", i, page_mapcount(i));
 	}
-	fprintf(stderr, "alloc %3u --> %-3u\n", vpn, pfn);
-	
-	return true;
+	fprintf(stderr, "\n");
 }
 
-static bool __free_page(unsigned int vpn)
+static void __show_tlb_stats(const char *name, struct tlb *tlb)
 {
-	unsigned int pfn;
+	unsigned long nr_lookups = tlb->nr_hits + tlb->nr_misses;
+
+	fprintf(stderr, "%-9s: %lu hits, %lu misses (%.2f%% hit), "
+			"reach %u pages (%.2f on average, %lu KB)\n", name,
+			tlb->nr_hits, tlb->nr_misses,
+			nr_lookups ? tlb->nr_hits * 100.0 / nr_lookups : 0.0,
+			tlb->reach,
+			nr_lookups ? (double)tlb->reach_sum / nr_lookups : 0.0,
+			((unsigned long)tlb->reach << page_shift) >> 10);
+}
 
-	if (!__translate(RW_READ, vpn, &pfn)) {
-		fprintf(stderr, "%u is not allocated\n", vpn);
-		return false;
+static void __show_coloring_stats(void)
+{
+	static const char *policies[] = {
+		[COLORING_NONE] = "none",
+		[COLORING_VPN] = "vpn",
+		[COLORING_PROCESS] = "process",
+	};
+	unsigned int nr_used[NR_CACHE_COLORS] = { 0 };
+	unsigned int nr_frames[NR_CACHE_COLORS] = { 0 };
+
+	for (unsigned int i = 0; i < nr_pageframes; i++) {
+		nr_frames[i % NR_CACHE_COLORS]++;
+		if (page_mapcount(i)) nr_used[i % NR_CACHE_COLORS]++;
 	}
-	fprintf(stderr, "free %u (pfn %u)\n", vpn, pfn);
-	free_page(vpn);
 
-	return true;
+	fprintf(stderr, "\n*** Page coloring (%s, %d colors) ***\n",
+			policies[page_coloring], NR_CACHE_COLORS);
+	for (unsigned int c = 0; c < NR_CACHE_COLORS; c++) {
+		fprintf(stderr, "%2u: %u/%u frames in use\n", c, nr_used[c],
+				nr_frames[c]);
+	}
+	fprintf(stderr, "fallbacks: %lu\n", nr_color_fallbacks);
 }
 
-static void __init_system(void)
+static void __show_host_stats(void)
 {
-	ptbr = &init.pagetable;
+	unsigned long rss = 0, huge = 0, kb;
+	char line[256];
+	struct timespec now;
+	double elapsed;
+	FILE *smaps;
+
+	smaps = fopen("/proc/self/smaps_rollup", "r");
+	if (smaps) {
+		while (fgets(line, sizeof(line), smaps)) {
+			if (sscanf(line, "Rss: %lu kB", &kb) == 1) rss = kb;
+			if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) huge = kb;
+		}
+		fclose(smaps);
+	}
 
-	list_add_tail(&init.list, &processes);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - simulation_start.tv_sec) +
+		(now.tv_nsec - simulation_start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "*** Host (%s pages) ***\n",
+			host_pages == HOST_PAGES_HUGE ? "huge" : "base");
+	fprintf(stderr, "rss      : %lu KB, %lu KB in huge pages\n", rss, huge);
+	fprintf(stderr, "speed    : %lu accesses in %.3f s (%.0f accesses/s)\n",
+			nr_accesses, elapsed, elapsed > 0 ? nr_accesses / elapsed : 0.0);
+	fprintf(stderr, "\n");
 }
 
-static void __show_pageframes(void)
+static void __show_stats(void)
 {
-	for (unsigned int i = 0; i < NR_PAGEFRAMES; i++) {
-		if (!mapcounts[i]) continue;
-		fprintf(stderr, "%3u: %d\n", i, mapcounts[i]);
-	}
+	unsigned long nr_lookups = tlb.nr_hits + tlb.nr_misses;
+
+	fprintf(stderr, "*** Memory accesses (%lu KB pages) ***\n",
+			(1UL << page_shift) >> 10);
+	fprintf(stderr, "accesses : %lu, page faults %lu, first touches %lu, rejected %lu\n",
+			nr_accesses, nr_page_faults, nr_first_touches,
+			nr_rejected_accesses + nr_unbacked_accesses);
+	fprintf(stderr, "copies   : %lu pages (%lu KB) for copy-on-write\n",
+			nr_copied_pages, (nr_copied_pages << page_shift) >> 10);
+	show_cache_stats("data", &data_cache_stats);
 	fprintf(stderr, "\n");
+
+	fprintf(stderr, "*** TLB (%d entries) ***\n", NR_TLB_ENTRIES);
+	__show_tlb_stats("baseline", &tlb_baseline);
+	__show_tlb_stats("coalesced", &tlb);
+	fprintf(stderr, "hit rate improvement: %+.2f%%p\n", nr_lookups ?
+			((double)tlb.nr_hits - (double)tlb_baseline.nr_hits) *
+				100.0 / nr_lookups : 0.0);
+	fprintf(stderr, "range    : %lu of %lu page walks eliminated (%.2f%%)\n",
+			nr_range_hits, tlb.nr_misses,
+			tlb.nr_misses ? nr_range_hits * 100.0 / tlb.nr_misses : 0.0);
+	fprintf(stderr, "\n*** TLB prefetchers (%d entries) ***\n", NR_PREFETCH_ENTRIES);
+	show_prefetch_stats(tlb.nr_misses);
+
+	__show_coloring_stats();
+
+	fprintf(stderr, "\n*** Overcommit (%s) ***\n",
+			overcommit_policy == OVERCOMMIT_STRICT ? "strict" : "heuristic");
+	fprintf(stderr, "committed: %lu pages, limit %lu pages, %lu refused\n",
+			nr_committed_pages, __commit_limit(), nr_commit_refusals);
+
+	fprintf(stderr, "\n*** Translation cost ***\n");
+	show_cache_stats("page walk", &walk_cache_stats);
+	fprintf(stderr, "total    : %lu cycles for %lu translations (%.2f per translation)\n",
+			translation_cycles, nr_translations,
+			nr_translations ? (double)translation_cycles / nr_translations : 0.0);
+	fprintf(stderr, "\n");
+
+	if (sampling_mode != SAMPLING_NONE) show_sampling_stats();
+	if (host_pages != HOST_PAGES_LIBC) __show_host_stats();
+	if (perf_enabled) show_perf_stats();
+	show_tracepoints();
 }
 
 static void __show_pagetable(void)
@@ -254,6 +1191,20 @@ static void __show_pagetable(void)
 	}
 }
 
+static void __show_ranges(void)
+{
+	fprintf(stderr, "\n*** PID %u ***\n", current->pid);
+
+	for (int i = 0; i < NR_RANGE_TRANSLATIONS; i++) {
+		struct range_translation *r = &current->pagetable.ranges[i];
+
+		if (!r->valid) continue;
+		fprintf(stderr, "[%u, %u) %c --> %u\n", r->base, r->limit,
+				r->writable ? 'w' : ' ', r->base + r->offset);
+	}
+	fprintf(stderr, "\n");
+}
+
 static void __print_help(void)
 {
 	printf("  help | ?     : Print out this help message \n");
@@ -263,12 +1214,24 @@ static void __print_help(void)
 	printf("                 Fork @pid if there is no process with the pid\n");
 	printf("  show         : Show the page table of the current process\n");
 	printf("  pages        : Show the status for each page frame\n");
+	printf("  guests       : Show the guests and their balloons\n");
+	printf("  balloon      : Balance the guests with their balloons\n");
+	printf("  guest [id] [frames]      : Make the current process join guest @id\n");
+	printf("  balloon [id] [pages]     : Inflate the balloon of guest @id\n");
+	printf("  deflate [id] [pages]     : Deflate the balloon of guest @id\n");
+	printf("  memadd [count]           : Hot-add @count page frames\n");
+	printf("  memremove [start] [count]: Hot-remove @count page frames from @start\n");
+	printf("  ranges       : Show the range translations of the current process\n");
+	printf("  stats        : Show the statistics of the simulation\n");
+	printf("  stats [pid]  : Show the statistics of process @pid\n");
 	printf("\n");
 	printf("  alloc [vpn] r|w  : Allocate a page for the rw flag\n");
 	printf("  free [vpn]       : Deallocate the page at VPN @vpn\n");
 	printf("  access [vpn] r|w : Access VPN @vpn for read or write\n");
 	printf("  read [vpn]       : Equivalent to access @vpn r\n");
 	printf("  write [vpn]      : Equivalent to access @vpn w\n");
+	printf("  load [addr]      : Read the byte address @addr\n");
+	printf("  store [addr]     : Write to the byte address @addr\n");
 	printf("\n");
 }
 
@@ -278,87 +1241,533 @@ static bool strmatch(char * const str, const char *expect)
 			(strncmp(str, expect, strlen(expect)) == 0);
 }
 
-static void __do_simulation(FILE *input)
+/**
+ * __simulate()
+ *
+ * DESCRIPTION
+ *   Simulate the trace operation @op.
+ *
+ * RETURN
+ *   @true to continue the simulation
+ *   @false to stop the simulation
+ */
+static bool __simulate(struct trace_op *op)
+{
+	unsigned int arg = op->args[0];
+	struct perf_sample sample;
+
+	switch (op->opcode) {
+	case TRACE_EXIT:
+		return false;
+	case TRACE_SHOW:
+		__show_pagetable();
+		break;
+	case TRACE_PAGES:
+		__show_pageframes();
+		break;
+	case TRACE_RANGES:
+		__show_ranges();
+		break;
+	case TRACE_GUESTS:
+		__show_guests();
+		break;
+	case TRACE_BALANCE:
+		__balance_guests();
+		break;
+	case TRACE_STATS:
+		__show_stats();
+		break;
+	case TRACE_HELP:
+		__print_help();
+		break;
+
+	case TRACE_PROCESS_STATS:
+		__show_process_stats(arg);
+		break;
+	case TRACE_SWITCH:
+		trace_switch_process(arg, current->pid);
+		perf_begin(PERF_FORK, &sample);
+		switch_process(arg);
+		perf_end(PERF_FORK, &sample);
+		__flush_tlb();
+		if (current->pid != arg) {
+			fprintf(stderr, "Unable to fork %u\n", arg);
+		}
+		break;
+	case TRACE_FREE:
+		__free_page(arg);
+		break;
+	case TRACE_READ:
+		__access_memory(arg, 0, RW_READ);
+		break;
+	case TRACE_WRITE:
+		__access_memory(arg, 0, RW_WRITE);
+		break;
+	case TRACE_MEMADD:
+		__add_memory(arg);
+		break;
+	case TRACE_LOAD:
+		__access_address(op->args[0], RW_READ);
+		break;
+	case TRACE_STORE:
+		__access_address(op->args[0], RW_WRITE);
+		break;
+
+	case TRACE_ALLOC:
+		return __alloc_page(arg, op->rw);
+	case TRACE_ACCESS:
+		__access_memory(arg, 0, op->rw);
+		break;
+	case TRACE_GUEST:
+		__set_guest(arg, op->args[1]);
+		break;
+	case TRACE_INFLATE:
+		__inflate_balloon(arg, op->args[1]);
+		break;
+	case TRACE_DEFLATE:
+		__deflate_balloon(arg, op->args[1]);
+		break;
+	case TRACE_MEMREMOVE:
+		__remove_memory(arg, op->args[1]);
+		break;
+
+	case TRACE_UNKNOWN:
+		printf("Unknown command %s\n", op->name);
+		break;
+	default:
+		assert(!"Unknown command in trace");
+	}
+
+	return true;
+}
+
+/**
+ * Run the ops from the input of CPU i as the process with pid i when the
+ * per-CPU traces are merged. The process of each CPU starts with an empty
+ * address space rather than being forked from the one that ran before it.
+ */
+static bool route_cpus = false;
+
+static void __route_cpu(unsigned int cpu)
+{
+	struct perf_sample sample;
+
+	if (!__find_process(cpu)) {
+		struct process *process = arena_calloc(1, sizeof(*process));
+
+		if (!process) {
+			fprintf(stderr, "Unable to create process %u\n", cpu);
+			return;
+		}
+		process->pid = cpu;
+		INIT_LIST_HEAD(&process->list);
+		list_add_tail(&process->list, &processes);
+	}
+
+	trace_switch_process(cpu, current->pid);
+	perf_begin(PERF_FORK, &sample);
+	switch_process(cpu);
+	perf_end(PERF_FORK, &sample);
+	__flush_tlb();
+	if (current->pid != cpu) {
+		fprintf(stderr, "Unable to fork %u\n", cpu);
+	}
+}
+
+static void __do_simulation(FILE *inputs[], unsigned int nr_inputs)
 {
-	char command[MAX_COMMAND_LEN] = { 0 };
+	struct trace *trace;
+	struct trace_op *op;
 
 	__init_system();
+	clock_gettime(CLOCK_MONOTONIC, &simulation_start);
+	if (perf_enabled && !open_perf_counters()) {
+		fprintf(stderr, "Host performance counters are not available\n");
+	}
+
+	if (sampling_mode == SAMPLING_SIMPOINT &&
+			!profile_simpoints(inputs, nr_inputs, page_shift)) {
+		fprintf(stderr, "Unable to profile the workload for sampling\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (nr_inputs > 1) {
+		trace = open_merged_trace(inputs, nr_inputs);
+	} else {
+		trace = open_trace(inputs[0]);
+	}
+	if (!trace) {
+		fprintf(stderr, "Unable to start ingesting the trace\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((op = next_trace_op(trace))) {
+		bool more;
+
+		if (route_cpus && op->cpu != current->pid) __route_cpu(op->cpu);
+		more = __simulate(op);
+
+		sync_arena();
+		if (!more) break;
+
+		if (verbose) printf(">> ");
+	}
+
+	close_trace(trace);
+	close_perf_counters();
+}
+
+/**
+ * Page sizes to run the simulation with. The simulation is swept over them
+ * when more than one page size is given.
+ */
+static unsigned int page_shifts[MAX_PAGE_SHIFT - MIN_PAGE_SHIFT + 1];
+static unsigned int nr_page_shifts = 0;
+
+static bool __parse_page_sizes(char *sizes)
+{
+	for (char *size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+		char *end;
+		unsigned long bytes = strtoul(size, &end, 0);
+		unsigned int shift;
+
+		if (*end == 'k' || *end == 'K') {
+			bytes <<= 10;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			bytes <<= 20;
+			end++;
+		}
+		if (*end != '\0' || !bytes || (bytes & (bytes - 1))) return false;
+
+		shift = __builtin_ctzl(bytes);
+		if (shift < MIN_PAGE_SHIFT || shift > MAX_PAGE_SHIFT) return false;
+		if (nr_page_shifts == sizeof(page_shifts) / sizeof(*page_shifts)) return false;
+
+		page_shifts[nr_page_shifts++] = shift;
+	}
+	return nr_page_shifts > 0;
+}
+
+static void __print_sweep_result(int node)
+{
+	unsigned long nr_lookups = tlb.nr_hits + tlb.nr_misses;
+	unsigned long nr_refs = 0;
+	unsigned long nr_pages, nr_remote;
+	char remote[16] = "-";
+	size_t size;
+	void *start;
+
+	for (int i = 0; i < NR_CACHE_LEVELS; i++) {
+		nr_refs += data_cache_stats.nr_hits[i];
+	}
+
+	if (node >= 0 && arena_extent(&start, &size) &&
+			count_remote_pages(start, size, node, &nr_pages, &nr_remote) && nr_pages) {
+		snprintf(remote, sizeof(remote), "%.2f%%", nr_remote * 100.0 / nr_pages);
+	}
 
-	while (fgets(command, sizeof(command), input)) {
-		char *tokens[MAX_NR_TOKENS] = { NULL };
-		int nr_tokens = 0;
+	printf("%7lu KB %10lu %8lu %8lu %8lu %7.2f%% %7.0f KB %7lu KB %10.2f %4d %8s\n",
+			(1UL << page_shift) >> 10, nr_accesses,
+			nr_rejected_accesses + nr_unbacked_accesses,
+			nr_page_faults, nr_first_touches,
+			nr_lookups ? tlb.nr_hits * 100.0 / nr_lookups : 0.0,
+			nr_lookups ? (double)(tlb.reach_sum << page_shift) / nr_lookups / 1024 : 0.0,
+			(nr_copied_pages << page_shift) >> 10,
+			nr_refs ? (double)data_cache_stats.cycles / nr_refs : 0.0,
+			node, remote);
+}
+
+/**
+ * __sweep_page_sizes()
+ *
+ * DESCRIPTION
+ *   Run the simulation with the trace in @filename for each page size in
+ *   @page_shifts, and summarize the result of each run in a row. Each run is
+ *   done in a child process so that it starts with a clean system.
+ *
+ *   The runs go in parallel. The i-th run is pinned to the i-th host node (in
+ *   round robin), and its state is allocated from an anonymous arena on the
+ *   node so that the run does not reach the other nodes. The ratio of the
+ *   arena pages ended up on the other nodes is reported as "remote". The rows
+ *   are passed through pipes to be printed in the order of the page sizes.
+ *   Unless -H is given, the arena is on the host base pages.
+ *
+ *   The address space spans fewer bytes with smaller pages, so the accesses
+ *   beyond it or to the pages no frame is left for are rejected and counted
+ *   in "rejected"; compare the rows with it in mind. The diagnostics of each
+ *   run are kept in a temporary file, and printed after the table.
+ *
+ *   If a run cannot be started, the runs already started are waited for, and
+ *   their rows are printed before failing.
+ */
+static int __sweep_page_sizes(const char *filename)
+{
+	pid_t pids[MAX_PAGE_SHIFT - MIN_PAGE_SHIFT + 1];
+	int pipes[MAX_PAGE_SHIFT - MIN_PAGE_SHIFT + 1];
+	FILE *logs[MAX_PAGE_SHIFT - MIN_PAGE_SHIFT + 1];
+	unsigned int nr_started;
+	int ret = EXIT_SUCCESS;
+
+	init_numa();
+	if (host_pages == HOST_PAGES_LIBC) {
+		fprintf(stderr, "The state of each run is kept on the host base pages\n");
+		host_pages = HOST_PAGES_BASE;
+	}
+
+	printf("%10s %10s %8s %8s %8s %8s %10s %10s %10s %4s %8s\n",
+			"page size", "accesses", "rejected", "faults", "touches", "TLB hit",
+			"TLB reach", "copied", "cycles/ref", "node", "remote");
+	fflush(stdout);
 
-		/* Make the command lowercase */
-		for (size_t i = 0; i < strlen(command); i++) {
-			command[i] = tolower(command[i]);
+	for (nr_started = 0; nr_started < nr_page_shifts; nr_started++) {
+		unsigned int i = nr_started;
+		int fds[2];
+
+		if (!(logs[i] = tmpfile())) {
+			perror("tmpfile");
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			fclose(logs[i]);
+			ret = EXIT_FAILURE;
+			break;
 		}
 
-		if (parse_command(command, &nr_tokens, tokens) < 0) {
-			continue;
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			close(fds[0]);
+			close(fds[1]);
+			fclose(logs[i]);
+			ret = EXIT_FAILURE;
+			break;
 		}
-		if (nr_tokens == 0) continue;
-
-		if (nr_tokens == 1) {
-			if (strmatch(tokens[0], "exit")) break;
-			if (strmatch(tokens[0], "show")) {
-				__show_pagetable();
-			} else if (strmatch(tokens[0], "pages")) {
-				__show_pageframes();
-			} else if (strmatch(tokens[0], "help") || strmatch(tokens[0], "?")) {
-				__print_help();
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
+
+		if (pids[i] == 0) {
+			FILE *input;
+			int node;
+
+			close(fds[0]);
+			if (dup2(fds[1], STDOUT_FILENO) < 0) _exit(EXIT_FAILURE);
+			close(fds[1]);
+
+			/* Bind before the simulator state is allocated */
+			node = bind_numa_node(i);
+
+			input = fopen(filename, "r");
+			if (!input) {
+				fprintf(stderr, "No input file %s\n", filename);
+				_exit(EXIT_FAILURE);
 			}
-		} else if (nr_tokens == 2) {
-			unsigned int arg = strtoimax(tokens[1], NULL, 0);
-
-			if (strmatch(tokens[0], "switch") || strmatch(tokens[0], "s")) {
-				switch_process(arg);
-			} else if (strmatch(tokens[0], "free") || strmatch(tokens[0], "f")) {
-				__free_page(arg);
-			} else if (strmatch(tokens[0], "read") || strmatch(tokens[0], "r")) {
-				__access_memory(arg, RW_READ);
-			} else if (strmatch(tokens[0], "write") || strmatch(tokens[0], "w")) {
-				__access_memory(arg, RW_WRITE);
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
+			fflush(stderr);
+			if (dup2(fileno(logs[i]), STDERR_FILENO) < 0) _exit(EXIT_FAILURE);
+
+			sweeping = true;
+			page_shift = page_shifts[i];
+			__do_simulation(&input, 1);
+			fclose(input);
+
+			if (nr_rejected_accesses) {
+				fprintf(stderr, "%lu accesses beyond the %lu KB address space rejected\n",
+						nr_rejected_accesses,
+						((unsigned long)NR_PTES_PER_PAGE * NR_PTES_PER_PAGE << page_shift) >> 10);
 			}
-		} else if (nr_tokens == 3) {
-			unsigned int vpn = strtoimax(tokens[1], NULL, 0);
-			unsigned int rw = __make_rwflag(tokens[2]);
-
-			if (strmatch(tokens[0], "alloc") || strmatch(tokens[0], "a")) {
-				if (!__alloc_page(vpn, rw)) break;
-			} else if (strmatch(tokens[0], "access")) {
-				__access_memory(vpn, rw);
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
+			if (nr_unbacked_accesses) {
+				fprintf(stderr, "%lu accesses rejected as memory is full\n",
+						nr_unbacked_accesses);
 			}
-		} else {
-			assert(!"Unknown command in trace");
+
+			__print_sweep_result(node);
+			fflush(stdout);
+			close_arena();
+			_exit(EXIT_SUCCESS);
 		}
 
-		if (verbose) printf(">> ");
+		close(fds[1]);
+		pipes[i] = fds[0];
+	}
+
+	for (unsigned int i = 0; i < nr_started; i++) {
+		char buffer[256];
+		ssize_t len;
+		int status;
+
+		while ((len = read(pipes[i], buffer, sizeof(buffer))) > 0) {
+			fwrite(buffer, 1, len, stdout);
+		}
+		close(pipes[i]);
+		fflush(stdout);
+
+		if (waitpid(pids[i], &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "Simulation with %lu KB pages failed\n",
+					(1UL << page_shifts[i]) >> 10);
+		}
+	}
+
+	for (unsigned int i = 0; i < nr_started; i++) {
+		char buffer[256];
+		size_t len;
+
+		rewind(logs[i]);
+		if ((len = fread(buffer, 1, sizeof(buffer), logs[i]))) {
+			fprintf(stderr, "\n*** Diagnostics with %lu KB pages ***\n",
+					(1UL << page_shifts[i]) >> 10);
+			do {
+				fwrite(buffer, 1, len, stderr);
+			} while ((len = fread(buffer, 1, sizeof(buffer), logs[i])));
+		}
+		fclose(logs[i]);
 	}
+
+	return ret;
 }
 
 static void __print_usage(const char * name)
 {
-	printf("Usage: %s {-q} {-f [workload file]}\n", name);
+	printf("Usage: %s {-q} {-a [arena file]} {-F [CPUs]} {-R [record|replay:log file]} {-e [csv file]} {-T [tracepoints]} {-P} {-H [host pages]} {-c [coloring]} {-o [overcommit]} {-s [page sizes]} {-z} {-r} {-S [sampling]} {-W [window]} {-w [warmup]} {-f [workload file] ...}\n", name);
 	printf("\n");
-	printf("  -q: Run quietly\n\n");
+	printf("  -q: Run quietly\n");
+	printf("  -a: Keep the simulator state in the arena file, and resume from it\n");
+	printf("  -F: Benchmark the fork storms on the concurrent engine with up to the\n");
+	printf("      given number of CPUs, and exit\n");
+	printf("  -R: Record the order of the synchronization events of the fork storms\n");
+	printf("      into the log file, or replay it (e.g., record:storm.log)\n");
+	printf("  -e: Export the statistics of the processes to the CSV file at the end\n");
+	printf("  -T: Enable the tracepoints (translate, fault, alloc, free, switch, all)\n");
+	printf("      with the sinks (counter, histogram, ring), e.g., fault,alloc:ring\n");
+	printf("  -P: Measure the host performance counters around the simulator phases\n");
+	printf("  -H: Host pages for the simulator state (huge, base), and report the\n");
+	printf("      host memory usage and the throughput\n");
+	printf("  -z: Compress the workload file to stdout in the built-in format\n");
+	printf("  -r: Run the commands from the i-th workload file as pid i,\n");
+	printf("      starting with an empty address space\n");
+	printf("  -S: Sample the accesses (systematic, simpoint, vpn), optionally with\n");
+	printf("      the period (e.g., systematic:10, simpoint:8 for 8 clusters, vpn:4)\n");
+	printf("  -W: Accesses per sampling window (default: %d)\n", DEFAULT_SAMPLE_WINDOW);
+	printf("  -w: Warmup accesses before each sampled window (default: %d)\n",
+			DEFAULT_SAMPLE_WARMUP);
+	printf("  -c: Page coloring policy of the allocator (none, vpn, process)\n");
+	printf("  -o: Overcommit policy (heuristic, strict)\n");
+	printf("  -s: Page size from 4K to 2M (default: 4K). Give comma-separated\n");
+	printf("      page sizes (e.g., 4k,64k,2m) to sweep the workload file over them\n\n");
+	printf("  Multiple workload files (e.g., one per CPU) are merged by the timestamps\n");
+	printf("  of the commands, which are given as \"@<timestamp> <command>\".\n\n");
 }
 
 int main(int argc, char * argv[])
 {
 	int opt;
 	FILE *input = stdin;
-
-	while ((opt = getopt(argc, argv, "qh")) != -1) {
+	bool compress = false;
+	FILE **inputs = &input;
+	unsigned int nr_inputs = 1;
+	unsigned int storm_cpus = 0;
+	enum sync_mode storm_sync = SYNC_FREE;
+	const char *storm_log = NULL;
+
+	while ((opt = getopt(argc, argv, "qa:F:R:e:T:PH:c:o:s:zrS:W:w:h")) != -1) {
 		switch (opt) {
 		case 'q':
 			verbose = false;
 			break;
+		case 'a':
+			arena_path = optarg;
+			break;
+		case 'F':
+			storm_cpus = strtoul(optarg, NULL, 0);
+			if (!storm_cpus || storm_cpus > MAX_ENGINE_CPUS) {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (!strncmp(optarg, "record:", 7)) {
+				storm_sync = SYNC_RECORD;
+			} else if (!strncmp(optarg, "replay:", 7)) {
+				storm_sync = SYNC_REPLAY;
+			} else {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			storm_log = optarg + 7;
+			break;
+		case 'e':
+			export_path = optarg;
+			break;
+		case 'T':
+			if (!enable_tracepoints(optarg)) {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			perf_enabled = true;
+			break;
+		case 'H':
+			if (strmatch(optarg, "huge")) {
+				host_pages = HOST_PAGES_HUGE;
+			} else if (strmatch(optarg, "base")) {
+				host_pages = HOST_PAGES_BASE;
+			} else {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			if (strmatch(optarg, "none")) {
+				page_coloring = COLORING_NONE;
+			} else if (strmatch(optarg, "vpn")) {
+				page_coloring = COLORING_VPN;
+			} else if (strmatch(optarg, "process")) {
+				page_coloring = COLORING_PROCESS;
+			} else {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (strmatch(optarg, "heuristic")) {
+				overcommit_policy = OVERCOMMIT_HEURISTIC;
+			} else if (strmatch(optarg, "strict")) {
+				overcommit_policy = OVERCOMMIT_STRICT;
+			} else {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (!__parse_page_sizes(optarg)) {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			page_shift = page_shifts[0];
+			break;
+		case 'z':
+			compress = true;
+			break;
+		case 'r':
+			route_cpus = true;
+			break;
+		case 'S':
+			if (!parse_sampling(optarg)) {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			sample_window = strtoul(optarg, NULL, 0);
+			if (!sample_window) {
+				__print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			sample_warmup = strtoul(optarg, NULL, 0);
+			break;
 		case 'h':
 		default:
 			__print_usage(argv[0]);
@@ -366,6 +1775,56 @@ int main(int argc, char * argv[])
 		}
 	}
 
+	if (storm_sync != SYNC_FREE && !storm_cpus) {
+		fprintf(stderr, "Recording or replaying the fork storms requires -F\n");
+		return EXIT_FAILURE;
+	}
+	if (storm_cpus) {
+		return benchmark_fork_storm(storm_cpus, storm_sync, storm_log) ?
+				EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (arena_path && host_pages != HOST_PAGES_LIBC) {
+		fprintf(stderr, "The arena file cannot be backed by the host pages\n");
+		return EXIT_FAILURE;
+	}
+
+	if (compress) {
+		if (!argv[optind] || !(input = fopen(argv[optind], "r"))) {
+			fprintf(stderr, "Compression requires a workload file\n");
+			return EXIT_FAILURE;
+		}
+		if (argv[optind + 1]) {
+			fprintf(stderr, "Compression takes one workload file only\n");
+			fclose(input);
+			return EXIT_FAILURE;
+		}
+		if (vmz_compress(input, stdout) || fflush(stdout)) {
+			fprintf(stderr, "Unable to compress %s\n", argv[optind]);
+			fclose(input);
+			return EXIT_FAILURE;
+		}
+		fclose(input);
+		return EXIT_SUCCESS;
+	}
+
+	if (nr_page_shifts > 1) {
+		if (!argv[optind]) {
+			fprintf(stderr, "Page size sweep requires a workload file\n");
+			return EXIT_FAILURE;
+		}
+		if (argv[optind + 1]) {
+			fprintf(stderr, "Page size sweep takes one workload file only\n");
+			return EXIT_FAILURE;
+		}
+		if (arena_path) {
+			fprintf(stderr, "Page size sweep cannot resume from an arena\n");
+			return EXIT_FAILURE;
+		}
+		verbose = false;
+		return __sweep_page_sizes(argv[optind]);
+	}
+
 	if (verbose && !argv[optind]) {
 		printf("***************************************************************************\n");
 		printf(" __      ____  __     _____ _                 _       _\n");
@@ -381,26 +1840,44 @@ int main(int argc, char * argv[])
 	}
 
 	if (argv[optind]) {
-		if (verbose) printf("Use file \"%s\" for input.\n", argv[optind]);
+		nr_inputs = argc - optind;
+		inputs = calloc(nr_inputs, sizeof(*inputs));
+		if (!inputs) return EXIT_FAILURE;
 
-		input = fopen(argv[optind], "r");
-		if (!input) {
-			fprintf(stderr, "No input file %s\n", argv[optind]);
-			return EXIT_FAILURE;
+		for (unsigned int i = 0; i < nr_inputs; i++) {
+			if (verbose) printf("Use file \"%s\" for input.\n", argv[optind + i]);
+
+			inputs[i] = fopen(argv[optind + i], "r");
+			if (!inputs[i]) {
+				fprintf(stderr, "No input file %s\n", argv[optind + i]);
+				return EXIT_FAILURE;
+			}
 		}
 		verbose = false;
 	} else {
 		if (verbose) printf("Use stdin for input.\n");
 	}
 
+	if (route_cpus && nr_inputs < 2) {
+		fprintf(stderr, "Routing CPUs requires per-CPU workload files\n");
+		return EXIT_FAILURE;
+	}
+
 	if (verbose) {
 		printf("Enter 'help' or '?' for help.\n\n");
 		printf(">> ");
 	}
 
-	__do_simulation(input);
+	__do_simulation(inputs, nr_inputs);
+	if (export_path && !__export_process_stats(export_path)) {
+		fprintf(stderr, "Unable to export the statistics to %s\n", export_path);
+	}
+	close_arena();
 
-	if (input != stdin) fclose(input);
+	for (unsigned int i = 0; i < nr_inputs; i++) {
+		if (inputs[i] != stdin) fclose(inputs[i]);
+	}
+	if (inputs != &input) free(inputs);
 
 	return EXIT_SUCCESS;
 }
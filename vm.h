@@ -16,23 +16,129 @@
 #define __VM_H__
 
 #include "types.h"
+#include "cache.h"
 
-/* The number of physical page frames of the system */
+/* The number of physical page frames of the system at boot */
 #define NR_PAGEFRAMES	128
 
 /* The number of PTEs in a page */
 #define PTES_PER_PAGE_SHIFT	4
 #define NR_PTES_PER_PAGE    (1 << PTES_PER_PAGE_SHIFT)
 
+/**
+ * The number of PTEs in a contiguous run. The allocator sets the @contig hint
+ * on every PTE in a naturally aligned group of NR_CONTIG_PTES when they map
+ * the naturally aligned consecutive page frames with the same permission.
+ */
+#define CONTIG_PTES_SHIFT	2
+#define NR_CONTIG_PTES		(1 << CONTIG_PTES_SHIFT)
+
+/**
+ * Page size is configurable in [MIN_PAGE_SHIFT, MAX_PAGE_SHIFT] at runtime.
+ * It determines how byte addresses are split into VPNs and offsets, and how
+ * many bytes a page holds.
+ */
+#define MIN_PAGE_SHIFT		12	/* 4 KB */
+#define MAX_PAGE_SHIFT		21	/* 2 MB */
+#define DEFAULT_PAGE_SHIFT	MIN_PAGE_SHIFT
+
+/**
+ * Page frames are colored by (pfn % NR_CACHE_COLORS). The frames of the same
+ * color compete for the same sets in the physically indexed LLC, so there are
+ * as many colors as the base pages spanned by one way of the LLC.
+ */
+#define LLC_SETS		(LLC_SIZE / LLC_WAYS / CACHE_LINE_SIZE)
+#define NR_CACHE_COLORS		(LLC_SETS * CACHE_LINE_SIZE >> MIN_PAGE_SHIFT)
+#define NR_COLOR_PARTITIONS	2
+
+enum page_coloring {
+	COLORING_NONE = 0,	/* Allocate the frame with the smallest pfn */
+	COLORING_VPN,		/* Match the frame color to the VPN color */
+	COLORING_PROCESS,	/* Partition colors among processes by pid */
+};
+
 #define RW_READ  0x01
 #define RW_WRITE 0x02
 
+/**
+ * Version of the layout of the simulator state kept in the arena. Bump it
+ * whenever a persistent variable or a structure reachable from them (e.g.,
+ * struct page, struct process) changes, so that the arenas of the older
+ * layouts are refused rather than restored as garbage.
+ *
+ * 1: Per-frame arrays of the mapcounts, offline flags, rmaps, and owners
+ * 2: Per-process statistics in struct process
+ * 3: struct page array replacing the per-frame arrays
+ * 4: 8-bit mapcount in struct page with the overflow table
+ * 5: Free frame bitmaps for the colors derived from the LLC geometry
+ */
+#define STATE_VERSION	5
+
+/**
+ * Page frame descriptor. The metadata of the page frames are kept in an array
+ * of these indexed by pfn so that an operation on a frame finds them in one
+ * place. The fields referenced on every frame operation come first; as the
+ * descriptor is 8-byte aligned, they never straddle a cache line. The spare
+ * bytes after them are left for the per-frame state to come.
+ */
+#define PG_OFFLINE	(1 << 0)	/* Removed from the frame space */
+
+struct rmap_item;
+
+struct page {
+	unsigned char _mapcount;	/* Use the accessors below */
+	unsigned char flags;
+	struct rmap_item *rmap;		/* Chain of the PTEs mapping the frame */
+	struct guest *owner;		/* Guest the frame is charged to */
+};
+
+extern struct page *mem_map;
+
+/**
+ * The number of PTEs mapping a frame is mostly 0 or 1, so it is kept in 8 bits
+ * in the descriptor. The counts from MAPCOUNT_OVERFLOW on (the frames shared
+ * by a lot of forked processes) are kept in a hash table instead, and
+ * @_mapcount of the frame is MAPCOUNT_OVERFLOW then.
+ */
+#define MAPCOUNT_OVERFLOW	0xff
+#define NR_MAPCOUNT_BUCKETS	256
+
+unsigned int __overflow_mapcount(unsigned int pfn);
+void __set_overflow_mapcount(unsigned int pfn, unsigned int count);
+
+static inline unsigned int page_mapcount(unsigned int pfn)
+{
+	unsigned int count = mem_map[pfn]._mapcount;
+
+	return count == MAPCOUNT_OVERFLOW ? __overflow_mapcount(pfn) : count;
+}
+
+static inline void set_page_mapcount(unsigned int pfn, unsigned int count)
+{
+	if (count < MAPCOUNT_OVERFLOW && mem_map[pfn]._mapcount != MAPCOUNT_OVERFLOW) {
+		mem_map[pfn]._mapcount = count;
+	} else {
+		__set_overflow_mapcount(pfn, count);
+	}
+}
+
+static inline void page_mapcount_inc(unsigned int pfn)
+{
+	set_page_mapcount(pfn, page_mapcount(pfn) + 1);
+}
+
+static inline void page_mapcount_dec(unsigned int pfn)
+{
+	set_page_mapcount(pfn, page_mapcount(pfn) - 1);
+}
+
 /**
  * 2-level page table abstraction
  */
 struct pte {
 	bool valid;
 	bool writable;
+	bool contig;	/* Contiguous hint; the PTE is a part of contiguous run */
 	unsigned int pfn;
 	unsigned int private;	/* May used to backup something ... */
 };
@@ -41,10 +147,88 @@ struct pte_directory {
 	struct pte ptes[NR_PTES_PER_PAGE];
 };
 
+/**
+ * Range translation that maps [@base, @limit) to [@base + @offset,
+ * @limit + @offset). The OS populates them for the regions backed by the
+ * contiguous page frames, and the MMU translates VPNs in the ranges without
+ * walking the page table.
+ */
+#define NR_RANGE_TRANSLATIONS	4
+#define MIN_RANGE_PAGES		2
+
+struct range_translation {
+	bool valid;
+	bool writable;
+	unsigned int base;
+	unsigned int limit;
+	unsigned int offset;
+};
+
 struct pagetable {
 	struct pte_directory *outer_ptes[NR_PTES_PER_PAGE];
+	struct range_translation ranges[NR_RANGE_TRANSLATIONS];
+};
+
+
+/**
+ * Guest that shares the page frames of the system with other guests. A guest
+ * can use up to (@nr_frames - @balloon) page frames. Inflating the balloon
+ * surrenders the frames of the guest to the host, and deflating it returns
+ * the frames from the host, possibly beyond @nr_frames.
+ */
+struct guest {
+	unsigned int id;
+	unsigned int nr_frames;
+	int balloon;
+	unsigned int nr_used;		/* Frames charged to the guest */
+
+	unsigned long nr_reclaimed;	/* Pages evicted to inflate the balloon */
+	unsigned long nr_gained;	/* Frames gained by deflating the balloon */
+
+	struct list_head list;
+};
+
+/**
+ * Overcommit policy. Writable private pages are charged to the commit, and
+ * forking a process charges the writable pages of the parent as they may be
+ * copied on write later. The commit limit is OVERCOMMIT_RATIO percent of
+ * the page frames.
+ */
+#define OVERCOMMIT_RATIO	100
+
+enum overcommit_policy {
+	OVERCOMMIT_HEURISTIC = 0,	/* Refuse obviously excessive requests only */
+	OVERCOMMIT_STRICT,		/* Refuse requests beyond the commit limit */
 };
 
+/**
+ * The balloon policy makes each guest keep this percent of its frames free
+ */
+#define BALLOON_FREE_TARGET	10
+
+/**
+ * Page faults by how they are resolved
+ */
+enum fault_type {
+	FAULT_COW,		/* Resolved by copying the shared page */
+	FAULT_REUSE,		/* Resolved by making the unshared page writable */
+	FAULT_PROTECTION,	/* Write to the read-only page */
+	FAULT_INVALID,		/* Access to the page not mapped */
+	NR_FAULT_TYPES,
+};
+
+/**
+ * Statistics of a process. The accesses and the faults are also counted per
+ * region, which is the range of VPNs covered by an outer PTE.
+ */
+struct process_stats {
+	unsigned long nr_accesses;
+	unsigned long nr_first_touches;
+	unsigned long nr_faults[NR_FAULT_TYPES];
+
+	unsigned long region_accesses[NR_PTES_PER_PAGE];
+	unsigned long region_faults[NR_PTES_PER_PAGE];
+};
 
 /**
  * Simplified PCB
@@ -53,6 +237,9 @@ struct process {
 	unsigned int pid;
 
 	struct pagetable pagetable;
+	struct guest *guest;	/* NULL if the process does not belong to a guest */
+	unsigned int nr_committed;	/* Pages charged to the commit */
+	struct process_stats stats;
 
 	struct list_head list;  /* List head to chain processes on the system */
 };
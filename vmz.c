@@ -0,0 +1,199 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "types.h"
+#include "vmz.h"
+
+/* Leave the last literals as literals so that a match never ends a block */
+#define LAST_LITERALS	5
+
+#define HASH_BITS	12
+
+static inline uint32_t __read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int __hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline unsigned char *__put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *__put_sequence(unsigned char *op,
+		const unsigned char *literals, size_t nr_literals,
+		size_t offset, size_t match_len)
+{
+	unsigned char *token = op++;
+	size_t len = match_len ? match_len - VMZ_MIN_MATCH : 0;
+
+	*token = (nr_literals < 15 ? nr_literals : 15) << 4;
+	if (nr_literals >= 15) op = __put_length(op, nr_literals - 15);
+
+	memcpy(op, literals, nr_literals);
+	op += nr_literals;
+
+	if (!match_len) return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	*token |= len < 15 ? len : 15;
+	if (len >= 15) op = __put_length(op, len - 15);
+
+	return op;
+}
+
+size_t vmz_compress_block(const unsigned char *src, size_t len, unsigned char *dst)
+{
+	unsigned int table[1 << HASH_BITS];
+	const unsigned char *anchor = src;
+	const unsigned char *ip = src;
+	const unsigned char *limit = src + (len > LAST_LITERALS ? len - LAST_LITERALS : 0);
+	unsigned char *op = dst;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (ip + VMZ_MIN_MATCH <= limit) {
+		uint32_t v = __read32(ip);
+		unsigned int h = __hash(v);
+		unsigned int pos = table[h];
+		const unsigned char *ref = src + pos;
+		size_t match_len = VMZ_MIN_MATCH;
+
+		table[h] = ip - src;
+		if (pos == ~0U || ip - ref > 0xffff || __read32(ref) != v) {
+			ip++;
+			continue;
+		}
+
+		while (ip + match_len < limit && ref[match_len] == ip[match_len]) {
+			match_len++;
+		}
+
+		op = __put_sequence(op, anchor, ip - anchor, ip - ref, match_len);
+		ip += match_len;
+		anchor = ip;
+	}
+
+	return __put_sequence(op, anchor, src + len - anchor, 0, 0) - dst;
+}
+
+static inline bool __get_length(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+	unsigned char c;
+
+	do {
+		if (*ip >= end) return false;
+		c = *(*ip)++;
+		*len += c;
+	} while (c == 255);
+
+	return true;
+}
+
+long vmz_decompress_block(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t capacity)
+{
+	const unsigned char *ip = src;
+	const unsigned char *end = src + len;
+	unsigned char *op = dst;
+	unsigned char *op_end = dst + capacity;
+
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t nr_literals = token >> 4;
+		size_t match_len = token & 0x0f;
+		size_t offset;
+
+		if (nr_literals == 15 && !__get_length(&ip, end, &nr_literals)) return -1;
+		if (nr_literals > (size_t)(end - ip) || nr_literals > (size_t)(op_end - op)) {
+			return -1;
+		}
+		memcpy(op, ip, nr_literals);
+		ip += nr_literals;
+		op += nr_literals;
+
+		/* The last sequence has no match */
+		if (ip == end) break;
+
+		if (end - ip < 2) return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (match_len == 15 && !__get_length(&ip, end, &match_len)) return -1;
+		match_len += VMZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t)(op - dst) ||
+				match_len > (size_t)(op_end - op)) {
+			return -1;
+		}
+		/* The match may overlap the output; copy byte by byte */
+		for (unsigned char *ref = op - offset; match_len--; ) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
+
+static void __put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+int vmz_compress(FILE *in, FILE *out)
+{
+	static unsigned char src[VMZ_BLOCK_SIZE];
+	static unsigned char dst[VMZ_HEADER_SIZE + VMZ_BOUND(VMZ_BLOCK_SIZE)];
+	size_t len;
+
+	if (fwrite(VMZ_MAGIC, VMZ_MAGIC_LEN, 1, out) != 1) return -1;
+
+	while ((len = fread(src, 1, sizeof(src), in)) > 0) {
+		size_t compressed = vmz_compress_block(src, len, dst + VMZ_HEADER_SIZE);
+
+		if (compressed >= len) {
+			memcpy(dst + VMZ_HEADER_SIZE, src, len);
+			compressed = len;
+			__put32(dst + 4, len | VMZ_STORED);
+		} else {
+			__put32(dst + 4, compressed);
+		}
+		__put32(dst, len);
+
+		if (fwrite(dst, VMZ_HEADER_SIZE + compressed, 1, out) != 1) return -1;
+	}
+
+	return ferror(in) ? -1 : 0;
+}
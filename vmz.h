@@ -0,0 +1,80 @@
+/**********************************************************************
+ * Copyright (c) 2020
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __VMZ_H__
+#define __VMZ_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * Built-in compressed trace format. The file starts with VMZ_MAGIC, which is
+ * followed by blocks of up to VMZ_BLOCK_SIZE bytes of the trace. Each block
+ * has the 32-bit little-endian raw length and compressed length, and then
+ * the compressed bytes. The block is stored as is when VMZ_STORED is set in
+ * the compressed length.
+ *
+ * A compressed block is a sequence of LZ77 matches. Each match is encoded
+ * as a token byte with the literal length in the upper 4 bits and the match
+ * length minus VMZ_MIN_MATCH in the lower 4 bits, the literal length bytes
+ * if the literal length is 15 or more, the literals, the 16-bit offset of the
+ * match, and the match length bytes if the match length is 15 or more. The
+ * last sequence has the literals only.
+ */
+#define VMZ_MAGIC		"VMZ1"
+#define VMZ_MAGIC_LEN		4
+#define VMZ_BLOCK_SIZE		(64 << 10)
+#define VMZ_HEADER_SIZE		8
+#define VMZ_STORED		0x80000000U
+#define VMZ_MIN_MATCH		4
+#define VMZ_BOUND(len)		((len) + (len) / 255 + 16)
+
+/***********************************************************************
+ * vmz_compress_block()
+ *
+ * DESCRIPTION
+ *  Compress @len bytes from @src into @dst, which should be able to hold
+ *  VMZ_BOUND(@len) bytes.
+ *
+ * RETURN VALUE
+ *  The number of bytes in @dst
+ */
+size_t vmz_compress_block(const unsigned char *src, size_t len, unsigned char *dst);
+
+/***********************************************************************
+ * vmz_decompress_block()
+ *
+ * DESCRIPTION
+ *  Decompress @len bytes from @src into @dst of @capacity bytes.
+ *
+ * RETURN VALUE
+ *  The number of bytes decompressed into @dst
+ *  -1 if the block is corrupted
+ */
+long vmz_decompress_block(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t capacity);
+
+/***********************************************************************
+ * vmz_compress()
+ *
+ * DESCRIPTION
+ *  Compress the trace from @in into @out in the built-in format.
+ *
+ * RETURN VALUE
+ *  Return 0 on success
+ *  Return -1 on error
+ */
+int vmz_compress(FILE *in, FILE *out);
+
+#endif